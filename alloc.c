@@ -1,65 +1,478 @@
+// Small blocks are carved from 64K pages in size classes, and a freed block
+// goes on the free list of its class. A block that would not fit the
+// largest class gets its own mapping, which free unmaps. Each block is
+// preceded by a word holding its class, or ALLOC_BIG for a mapping, in the
+// low byte and the serial number it was allocated under above that.
+//
+// alloc_mark and alloc_release drop everything allocated in between at
+// once. Released pages are kept for reuse, so a loop that releases what it
+// allocates runs in constant memory.
+
+enum {
+	ALLOC_NCLASS = 19,
+	ALLOC_MAXSMALL = 2048,
+	ALLOC_BIG = 255,
+}
+
 struct page {
+	next: *page;
+	prev: *page;
 	ptr: *byte;
 	fill: int;
 	size: int;
+	serial: int;
 }
 
 struct alloc {
 	page: *page;
+	big: *page;
+	spare: *page;
+	serial: int;
+	freelist: **byte;
+	mark: *alloc_mark;
+
+	// Blocks handed out and blocks freed, not counting those dropped by
+	// alloc_release, and bytes currently mapped.
+	nalloc: int;
+	nfree: int;
+	mapped: int;
+}
+
+struct alloc_mark {
+	prev: *alloc_mark;
+	page: *page;
+	fill: int;
+	serial: int;
+	freelist: **byte;
 }
 
 setup_alloc(c: *alloc) {
 	c.page = 0: *page;
+	c.big = 0: *page;
+	c.spare = 0: *page;
+	c.serial = 0;
+	c.nalloc = 0;
+	c.nfree = 0;
+	c.mapped = 0;
+	c.mark = 0:*alloc_mark;
+	c.freelist = alloc_table(c);
 }
 
-alloc(c: *alloc, size: int): *byte {
+// Classes are multiples of 16 bytes up to 256, then 512, 1024 and 2048.
+// n includes the header.
+alloc_class(n: int): int {
+	if (n <= 256) {
+		return ((n + 15) >> 4) - 1;
+	}
+
+	if (n <= 512) {
+		return 16;
+	}
+
+	if (n <= 1024) {
+		return 17;
+	}
+
+	return 18;
+}
+
+alloc_class_size(k: int): int {
+	if (k < 16) {
+		return (k + 1) << 4;
+	}
+
+	return 256 << (k - 15);
+}
+
+// Take n bytes from the current page, starting a new one if they do not fit
+alloc_bump(c: *alloc, n: int): *byte {
 	var page: *page;
 	var mret: int;
 	var ret: *byte;
 	var psize: int;
 
-	if (size < 0) {
-		die("invalid alloc");
+	page = c.page;
+	if (page) {
+		if (n <= page.size - page.fill) {
+			ret = &page.ptr[page.fill];
+			page.fill = page.fill + n;
+			return ret;
+		}
 	}
 
-	if (size >= 2048) {
-		size = size + 4095;
-		size = size & ~4095;
-		mret = mmap(0, size, 3, 0x22, -1, 0);
-		if (mret == -1) {
+	page = c.spare;
+	if (page) {
+		c.spare = page.next;
+	} else {
+		psize = 64 * 1024;
+
+		mret = mmap(0, psize, 3, 0x22, -1, 0);
+		if (mret < 0) {
 			die("out of memory");
 		}
-		ret = mret: *byte;
-		return ret;
+
+		c.mapped = c.mapped + psize;
+
+		page = mret: *page;
+		page.ptr = (&page[1]): *byte;
+		page.size = psize - sizeof(*page);
+		page.prev = 0:*page;
+		page.serial = 0;
 	}
 
-	page = c.page;
-	if (page) {
-		if (size <= page.size - page.fill) {
-			mret = page.ptr:int + page.fill;
-			page.fill = page.fill + size;
-			ret = mret: *byte;
-			return ret;
+	page.fill = n;
+	page.next = c.page;
+	c.page = page;
+
+	return page.ptr;
+}
+
+// An empty set of free lists
+alloc_table(c: *alloc): **byte {
+	var t: **byte;
+	var i: int;
+
+	t = alloc_bump(c, ALLOC_NCLASS * sizeof(*t)): **byte;
+
+	i = 0;
+	loop {
+		if (i == ALLOC_NCLASS) {
+			break;
 		}
+		t[i] = 0:*byte;
+		i = i + 1;
 	}
 
-	psize = 64 * 1024;
+	return t;
+}
+
+// Map a block of its own. The list of mappings is kept newest first by
+// serial so that alloc_release can stop at the first one older than the
+// mark.
+alloc_big(c: *alloc, size: int, serial: int): *byte {
+	var page: *page;
+	var prev: *page;
+	var next: *page;
+	var mret: int;
+	var psize: int;
+	var h: *int;
 
+	psize = size + sizeof(*page) + 8 + 4095;
+	psize = psize & ~4095;
 	mret = mmap(0, psize, 3, 0x22, -1, 0);
-	if (mret == -1) {
+	if (mret < 0) {
 		die("out of memory");
 	}
 
+	c.mapped = c.mapped + psize;
+
 	page = mret: *page;
 	page.ptr = (&page[1]): *byte;
-	ret = page.ptr;
 	page.size = psize - sizeof(*page);
-	page.fill = size;
+	page.fill = size + 8;
+	page.serial = serial;
 
-	c.page = page;
+	prev = 0:*page;
+	next = c.big;
+	loop {
+		if (!next || next.serial <= serial) {
+			break;
+		}
+		prev = next;
+		next = next.next;
+	}
+
+	page.prev = prev;
+	page.next = next;
+	if (prev) {
+		prev.next = page;
+	} else {
+		c.big = page;
+	}
+	if (next) {
+		next.prev = page;
+	}
+
+	h = page.ptr: *int;
+	*h = ALLOC_BIG;
+
+	return &page.ptr[8];
+}
+
+alloc(c: *alloc, size: int): *byte {
+	var k: int;
+	var p: *byte;
+	var h: *int;
+	var link: **byte;
+
+	if (size < 0) {
+		die("invalid alloc");
+	}
+
+	c.nalloc = c.nalloc + 1;
+
+	if (size + 8 > ALLOC_MAXSMALL) {
+		p = alloc_big(c, size, c.serial);
+		c.serial = c.serial + 1;
+		return p;
+	}
+
+	k = alloc_class(size + 8);
+
+	p = c.freelist[k];
+	if (p) {
+		link = (&p[8]): **byte;
+		c.freelist[k] = *link;
+	} else {
+		p = alloc_bump(c, alloc_class_size(k));
+	}
+
+	h = p: *int;
+	*h = (c.serial << 8) | k;
+
+	return &p[8];
+}
+
+// The free lists that a small block allocated under serial goes back to:
+// those in use when it was allocated, which the marks taken since have
+// saved away.
+alloc_freelist(c: *alloc, serial: int): **byte {
+	var list: **byte;
+	var m: *alloc_mark;
+
+	list = c.freelist;
+	m = c.mark;
+	loop {
+		if (!m || serial >= m.serial) {
+			return list;
+		}
+		list = m.freelist;
+		m = m.prev;
+	}
+}
+
+// The page of a block from alloc_big
+alloc_page(p: *byte): *page {
+	var page: *page;
+	page = (p:int - 8): *page;
+	return &page[-1];
+}
+
+free(c: *alloc, p: *byte): void {
+	var b: *byte;
+	var k: int;
+	var page: *page;
+	var link: **byte;
+	var list: **byte;
+
+	if (!p) {
+		return;
+	}
+
+	b = (p:int - 8): *byte;
+	k = *(b: *int) & 255;
+
+	c.nfree = c.nfree + 1;
+
+	if (k == ALLOC_BIG) {
+		page = alloc_page(p);
+
+		if (page.prev) {
+			page.prev.next = page.next;
+		} else {
+			c.big = page.next;
+		}
+
+		if (page.next) {
+			page.next.prev = page.prev;
+		}
+
+		c.mapped = c.mapped - (page.size + sizeof(*page));
+		munmap(page: int, page.size + sizeof(*page));
+		return;
+	}
+
+	if (k < 0 || k >= ALLOC_NCLASS) {
+		die("free: invalid pointer");
+	}
+
+	list = alloc_freelist(c, *(b: *int) >> 8);
+	link = p: **byte;
+	*link = list[k];
+	list[k] = b;
+}
+
+// Resize a block, keeping its contents up to the smaller of the two sizes.
+// A mapping grows in place or is moved by the kernel rather than copied,
+// where the kernel can.
+// A small block from before the current mark that has to move gets a
+// mapping of its own under its old serial, so that it survives
+// alloc_release.
+realloc(c: *alloc, p: *byte, size: int): *byte {
+	var k: int;
+	var serial: int;
+	var page: *page;
+	var psize: int;
+	var mret: int;
+	var q: *byte;
+	var n: int;
+
+	if (!p) {
+		return alloc(c, size);
+	}
+
+	if (size < 0) {
+		die("invalid realloc");
+	}
+
+	k = *((p:int - 8): *int) & 255;
+	serial = *((p:int - 8): *int) >> 8;
+
+	if (k == ALLOC_BIG) {
+		page = alloc_page(p);
+
+		if (size + 8 <= page.size) {
+			page.fill = size + 8;
+			return p;
+		}
+
+		n = page.size + sizeof(*page);
+		psize = size + sizeof(*page) + 8 + 4095;
+		psize = psize & ~4095;
+		mret = mremap(page: int, n, psize, MREMAP_MAYMOVE);
+		if (mret < 0) {
+			// No mremap, as on our own kernel: map a new block and copy
+			c.nalloc = c.nalloc + 1;
+			q = alloc_big(c, size, page.serial);
+			memcpy(q, p, page.fill - 8);
+			free(c, p);
+			return q;
+		}
+
+		c.mapped = c.mapped + psize - n;
+
+		page = mret: *page;
+		page.ptr = (&page[1]): *byte;
+		page.size = psize - sizeof(*page);
+		page.fill = size + 8;
+
+		if (page.prev) {
+			page.prev.next = page;
+		} else {
+			c.big = page;
+		}
+
+		if (page.next) {
+			page.next.prev = page;
+		}
+
+		return &page.ptr[8];
+	}
+
+	n = alloc_class_size(k) - 8;
+	if (size <= n) {
+		return p;
+	}
+
+	if (c.mark && serial < c.mark.serial) {
+		c.nalloc = c.nalloc + 1;
+		q = alloc_big(c, size, serial);
+	} else {
+		q = alloc(c, size);
+	}
+	memcpy(q, p, n);
+	free(c, p);
+
+	return q;
+}
+
+// Save the allocator state so everything allocated after this point can be
+// dropped at once by alloc_release. Blocks allocated and freed in between
+// go on free lists of their own, which are dropped with them; blocks from
+// before the mark go back to the lists it saved. Marks nest, and must be
+// released innermost first.
+alloc_mark(c: *alloc): *alloc_mark {
+	var m: *alloc_mark;
+	var page: *page;
+	var fill: int;
+
+	page = c.page;
+	fill = page.fill;
+
+	m = alloc_bump(c, sizeof(*m)): *alloc_mark;
+
+	c.serial = c.serial + 1;
+
+	m.prev = c.mark;
+	m.page = page;
+	m.fill = fill;
+	m.serial = c.serial;
+	m.freelist = c.freelist;
+
+	c.mark = m;
+	c.freelist = alloc_table(c);
+
+	return m;
+}
+
+// Free everything allocated since the mark was taken, including the mark.
+// Large blocks are unmapped and pages go to the spare list.
+alloc_release(c: *alloc, m: *alloc_mark) {
+	var page: *page;
+	var fill: int;
+	var serial: int;
+	var p: *page;
+
+	page = m.page;
+	fill = m.fill;
+	serial = m.serial;
+	c.freelist = m.freelist;
+	c.mark = m.prev;
+
+	loop {
+		p = c.big;
+		if (!p || p.serial < serial) {
+			break;
+		}
+		c.big = p.next;
+		if (c.big) {
+			c.big.prev = 0:*page;
+		}
+		c.mapped = c.mapped - (p.size + sizeof(*p));
+		munmap(p: int, p.size + sizeof(*p));
+	}
+
+	loop {
+		p = c.page;
+		if (p == page) {
+			break;
+		}
+		c.page = p.next;
+		p.next = c.spare;
+		c.spare = p;
+	}
+
+	page.fill = fill;
+}
+
+// A scratch arena is an allocator of its own for temporary buffers, so
+// that long-lived allocations can still be made while it is in use.
+// scratch_reset drops all of the buffers and keeps the pages for next time.
+struct scratch {
+	a: alloc;
+	base: *alloc_mark;
+}
+
+setup_scratch(s: *scratch) {
+	setup_alloc(&s.a);
+	s.base = alloc_mark(&s.a);
+}
 
-	return ret;
+scratch_alloc(s: *scratch, size: int): *byte {
+	return alloc(&s.a, size);
 }
 
-free(a: *alloc, p: *byte): void {
+scratch_reset(s: *scratch) {
+	alloc_release(&s.a, s.base);
+	s.base = alloc_mark(&s.a);
 }
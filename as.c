@@ -88,6 +88,7 @@ enum {
 	OP_IRET = 0xcf,
 	OP_IRETQ = 0x48cf,
 	OP_WRMSR = 0x0f30,
+	OP_RDTSC = 0x0f31,
 	OP_RDMSR = 0x0f32,
 	OP_RDCRR = 0x0f20,
 	OP_WRCRR = 0x0f22,
@@ -142,6 +143,20 @@ enum {
 	OP_MOVE = 0x8b,
 }
 
+// The image is loaded at LOAD_ADDR, and the text starts TEXT_OFF bytes
+// in: after the ELF and program headers, the multiboot header and a short
+// nop sled, see writeout. The multiboot load_end_addr is at LOAD_END.
+//
+// The kernel's early page tables, gdt and stack take the BOOT_SIZE bytes
+// after the page holding load_end_addr. _kstart in kernel.c starts its
+// allocations past them.
+enum {
+	LOAD_ADDR = 0x100000,
+	TEXT_OFF = 160,
+	LOAD_END = 140,
+	BOOT_SIZE = 0x8000,
+}
+
 struct fixup {
 	next: *fixup;
 	ptr: *byte;
@@ -161,6 +176,13 @@ struct chunk {
 	cap: int;
 }
 
+struct symbol {
+	next: *symbol;
+	name: *byte;
+	at: int;
+	size: int;
+}
+
 struct assembler {
 	a: *alloc;
 	out: *file;
@@ -168,6 +190,12 @@ struct assembler {
 	text: *chunk;
 	text_end: *chunk;
 	bits32: int;
+
+	// Function symbols sorted by address
+	symtab: int;
+	syms: *symbol;
+	nsyms: int;
+	strsize: int;
 }
 
 setup_assembler(a: *alloc): *assembler {
@@ -179,6 +207,10 @@ setup_assembler(a: *alloc): *assembler {
 	c.text = 0:*chunk;
 	c.text_end = 0:*chunk;
 	c.bits32 = 0;
+	c.symtab = 0;
+	c.syms = 0:*symbol;
+	c.nsyms = 0;
+	c.strsize = 0;
 	return c;
 }
 
@@ -186,6 +218,233 @@ putchar(c: *assembler, ch: int) {
 	fputc(c.out, ch);
 }
 
+// Write the low n bytes of x in little endian order
+putword(c: *assembler, x: int, n: int) {
+	loop {
+		if (n == 0) {
+			break;
+		}
+		putchar(c, x);
+		x = x >> 8;
+		n = n - 1;
+	}
+}
+
+putzero(c: *assembler, n: int) {
+	putword(c, 0, n);
+}
+
+// Record a function starting at offset at of the text
+as_symbol(c: *assembler, name: *byte, at: int) {
+	var s: *symbol;
+	var p: **symbol;
+
+	s = alloc(c.a, sizeof(*s)):*symbol;
+	s.name = name;
+	s.at = at;
+	s.size = 0;
+
+	p = &c.syms;
+	loop {
+		if (!*p || (*p).at > at) {
+			break;
+		}
+		p = &(*p).next;
+	}
+
+	s.next = *p;
+	*p = s;
+
+	c.nsyms = c.nsyms + 1;
+	c.strsize = c.strsize + strlen(name) + 1;
+}
+
+// Each function extends to the start of the next
+size_symbols(c: *assembler) {
+	var s: *symbol;
+
+	s = c.syms;
+	loop {
+		if (!s) {
+			break;
+		}
+
+		if (s.next) {
+			s.size = s.next.at - s.at;
+		} else {
+			s.size = c.at - s.at;
+		}
+
+		s = s.next;
+	}
+}
+
+// Write the .strtab, .symtab and .shstrtab sections and the section headers
+// that follow the text at offset off.
+write_symtab(c: *assembler, off: int, load_addr: int) {
+	var s: *symbol;
+	var strtab_off: int;
+	var symtab_off: int;
+	var shstrtab_off: int;
+	var name: int;
+	var i: int;
+
+	strtab_off = off;
+	symtab_off = (strtab_off + 1 + c.strsize + 7) & -8;
+	shstrtab_off = symtab_off + 24 * (c.nsyms + 1);
+
+	// .strtab
+	putchar(c, 0);
+	s = c.syms;
+	loop {
+		if (!s) {
+			break;
+		}
+		fputs(c.out, s.name);
+		putchar(c, 0);
+		s = s.next;
+	}
+	putzero(c, symtab_off - (strtab_off + 1 + c.strsize));
+
+	// .symtab
+	putzero(c, 24);
+	name = 1;
+	s = c.syms;
+	loop {
+		if (!s) {
+			break;
+		}
+		putword(c, name, 4);
+		// STB_GLOBAL, STT_FUNC
+		putchar(c, 0x12);
+		putchar(c, 0);
+		// .text
+		putword(c, 1, 2);
+		putword(c, load_addr + TEXT_OFF + s.at, 8);
+		putword(c, s.size, 8);
+		name = name + strlen(s.name) + 1;
+		s = s.next;
+	}
+
+	// .shstrtab
+	putchar(c, 0);
+	fputs(c.out, ".text");
+	putchar(c, 0);
+	fputs(c.out, ".symtab");
+	putchar(c, 0);
+	fputs(c.out, ".strtab");
+	putchar(c, 0);
+	fputs(c.out, ".shstrtab");
+	putchar(c, 0);
+	putzero(c, 7);
+
+	// shdr[0]
+	putzero(c, 64);
+
+	// shdr[1] .text
+	putword(c, 1, 4);
+	putword(c, 1, 4);
+	putword(c, 6, 8);
+	putword(c, load_addr + TEXT_OFF, 8);
+	putword(c, TEXT_OFF, 8);
+	putword(c, c.at, 8);
+	putword(c, 0, 4);
+	putword(c, 0, 4);
+	putword(c, 16, 8);
+	putword(c, 0, 8);
+
+	// shdr[2] .symtab
+	putword(c, 7, 4);
+	putword(c, 2, 4);
+	putword(c, 0, 8);
+	putword(c, 0, 8);
+	putword(c, symtab_off, 8);
+	putword(c, 24 * (c.nsyms + 1), 8);
+	putword(c, 3, 4);
+	putword(c, 1, 4);
+	putword(c, 8, 8);
+	putword(c, 24, 8);
+
+	// shdr[3] .strtab
+	putword(c, 15, 4);
+	putword(c, 3, 4);
+	putword(c, 0, 8);
+	putword(c, 0, 8);
+	putword(c, strtab_off, 8);
+	putword(c, 1 + c.strsize, 8);
+	putword(c, 0, 4);
+	putword(c, 0, 4);
+	putword(c, 1, 8);
+	putword(c, 0, 8);
+
+	// shdr[4] .shstrtab
+	putword(c, 23, 4);
+	putword(c, 3, 4);
+	putword(c, 0, 8);
+	putword(c, 0, 8);
+	putword(c, shstrtab_off, 8);
+	putword(c, 33, 8);
+	putword(c, 0, 4);
+	putword(c, 0, 4);
+	putword(c, 1, 8);
+	putword(c, 0, 8);
+}
+
+fputhex(f: *file, x: int) {
+	var d: int;
+
+	d = 64;
+	loop {
+		if (d == 4 || (x >> (d - 4)) != 0) {
+			break;
+		}
+		d = d - 4;
+	}
+
+	loop {
+		if (d == 0) {
+			break;
+		}
+		d = d - 4;
+		fputc(f, "0123456789abcdef"[(x >> d) & 15]:int);
+	}
+}
+
+// Write a perf map listing the functions, one "start size name" per line
+write_perfmap(c: *assembler, filename: *byte) {
+	var fd: int;
+	var f: *file;
+	var s: *symbol;
+
+	size_symbols(c);
+
+	unlink(filename);
+
+	fd = open(filename, O_CREAT | O_WRONLY, (6 << 6) + (6 << 3) + 6);
+	if (fd < 0) {
+		die("failed to open map");
+	}
+
+	f = fopen(fd, c.a);
+
+	s = c.syms;
+	loop {
+		if (!s) {
+			break;
+		}
+		fputhex(f, LOAD_ADDR + TEXT_OFF + s.at);
+		fputc(f, ' ');
+		fputhex(f, s.size);
+		fputc(f, ' ');
+		fputs(f, s.name);
+		fputc(f, '\n');
+		s = s.next;
+	}
+
+	fflush(f);
+	fclose(f);
+}
+
 open_output(c: *assembler, filename: *byte) {
 	var fd: int;
 
@@ -201,6 +460,15 @@ open_output(c: *assembler, filename: *byte) {
 	}
 
 	c.out = fopen(fd, c.a);
+	fsetbuf(c.out, BUF_FULL, 64 * 1024);
+}
+
+close_output(c: *assembler) {
+	if (c.out) {
+		fflush(c.out);
+		fclose(c.out);
+	}
+	c.out = 0:*file;
 }
 
 // Create a new label
@@ -338,6 +606,16 @@ emit_blob(c: *assembler, s: *byte, n: int) {
 
 	as_jmp(c, OP_JMP, b);
 
+	// Start the blob on a page boundary in memory, so that an included
+	// file can be mapped in place. The text is loaded TEXT_OFF bytes past a
+	// page boundary, see writeout.
+	loop {
+		if ((c.at + TEXT_OFF) & 4095) == 0 {
+			break;
+		}
+		as_emit(c, 0);
+	}
+
 	fixup_label(c, a);
 
 	i = 0;
@@ -420,8 +698,11 @@ emit_kstart(c: *assembler) {
 	as_modrr(c, OP_CMPRM, R_RAX, R_RDX);
 	as_jmp(c, OP_JCC + CC_NE, hang);
 
-	// Setup an early stack
-	as_modri(c, OP_MOVI, R_RSP, 0x00300000);  // FIXME bss
+	// Setup an early stack past the end of the image, which is where the
+	// multiboot header says it loaded up to
+	as_modri(c, OP_MOVI, R_RAX, LOAD_ADDR + LOAD_END);
+	as_modrm(c, OP_LOAD, R_RSP, R_RAX, 0, 0, 0);
+	as_modri(c, OP_ADDI, R_RSP, 4095 + BOOT_SIZE);
 
 	// Align stack to page
 	as_modri(c, OP_ANDI, R_RSP, -0x1000);
@@ -494,9 +775,10 @@ emit_kstart(c: *assembler) {
 	as_modri(c, OP_ORI, R_RAX, 0x100);
 	as_op(c, OP_WRMSR);
 
-	// Enable paging
+	// Enable paging, with write protect so that kernel writes to read-only
+	// user pages fault like user writes do
 	as_modrr(c, OP_RDCRR, R_CR0, R_RAX);
-	as_modri(c, OP_ORI, R_RAX, (-0x8000 << 16) | (0x0001));
+	as_modri(c, OP_ORI, R_RAX, (-0x8000 << 16) | (0x10000) | (0x0001));
 	as_modrr(c, OP_WRCRR, R_CR0, R_RAX);
 
 	// flags
@@ -813,7 +1095,6 @@ emit_syscall(c: *assembler) {
 
 writeout(c: *assembler, start: *label, kstart: *label) {
 	var b: *chunk;
-	var i: int;
 	var text_size: int;
 	var text_end: int;
 	var load_addr: int;
@@ -823,20 +1104,23 @@ writeout(c: *assembler, start: *label, kstart: *label) {
 	var mb_flags: int;
 	var mb_checksum: int;
 	var mb_addr: int;
+	var shoff: int;
+	var shnum: int;
+	var shstrndx: int;
 
 	if (!c.out) {
 		open_output(c, "a.out");
 	}
 
-	load_addr = 0x100000;
+	load_addr = LOAD_ADDR;
 	text_size = c.at;
 
 	if (!start || !start.fixed) {
 		die("_start is not defined");
 	}
 
-	entry = load_addr + start.at + 128 + 32;
-	text_size = text_size + 128 + 32;
+	entry = load_addr + start.at + TEXT_OFF;
+	text_size = text_size + TEXT_OFF;
 	text_end = load_addr + text_size;
 
 	mb_magic = 0x1badb002;
@@ -845,12 +1129,25 @@ writeout(c: *assembler, start: *label, kstart: *label) {
 	mb_addr = load_addr + 120;
 
 	if (kstart && kstart.fixed) {
-		kentry = load_addr + kstart.at + 128 + 32;
+		kentry = load_addr + kstart.at + TEXT_OFF;
 	} else {
 		mb_magic = 0;
 		kentry = 0;
 	}
 
+	// Section headers go after the symbol table, which is not loaded
+	if (c.symtab) {
+		size_symbols(c);
+		shoff = (text_size + 1 + c.strsize + 7) & -8;
+		shoff = shoff + 24 * (c.nsyms + 1) + 40;
+		shnum = 5;
+		shstrndx = 4;
+	} else {
+		shoff = 0;
+		shnum = 0;
+		shstrndx = 0;
+	}
+
 	// magic
 	putchar(c, 0x7f);
 	putchar(c, 'E');
@@ -916,10 +1213,10 @@ writeout(c: *assembler, start: *label, kstart: *label) {
 	putchar(c, 0);
 
 	// shoff
-	putchar(c, 0);
-	putchar(c, 0);
-	putchar(c, 0);
-	putchar(c, 0);
+	putchar(c, shoff);
+	putchar(c, shoff >> 8);
+	putchar(c, shoff >> 16);
+	putchar(c, shoff >> 24);
 	putchar(c, 0);
 	putchar(c, 0);
 	putchar(c, 0);
@@ -948,11 +1245,11 @@ writeout(c: *assembler, start: *label, kstart: *label) {
 	putchar(c, 0);
 
 	// shnum
-	putchar(c, 0);
+	putchar(c, shnum);
 	putchar(c, 0);
 
 	// shstrndx
-	putchar(c, 0);
+	putchar(c, shstrndx);
 	putchar(c, 0);
 
 	// phdr[0].type
@@ -1090,17 +1387,14 @@ writeout(c: *assembler, start: *label, kstart: *label) {
 		if (!b) {
 			break;
 		}
-		i = 0;
-		loop {
-			if (i >= b.fill) {
-				break;
-			}
-			putchar(c, b.buf[i]: int);
-			i = i + 1;
-		}
+		fwrite(c.out, b.buf, b.fill);
 		b = b.next;
 	}
 
+	if (c.symtab) {
+		write_symtab(c, text_size, load_addr);
+	}
+
 	fflush(c.out);
 }
 
@@ -1,10 +1,12 @@
 #!/bin/sh
 
 LIBS="bufio.c lib.c alloc.c syscall.c"
-SOURCES="cc1.c type.c parse1.c lex1.c as.c"
+SOURCES="cc1.c type.c parse1.c lex1.c as.c cache.c sha256.c"
 
 gcc -Wall -Wextra -Wno-unused -pedantic -std=c99 ./cc0.c -o cc0
 
+# cc0 does not know goto, so the first compilers use the hand-written
+# scanner in lex1.c. build.sh then builds cc2 with the one from genlex.
 ./cc0 ${LIBS} ${SOURCES} -o cc1
 
 ./cc1 ${LIBS} ${SOURCES} -o cc2
@@ -1,3 +1,12 @@
+// Buffering modes for writes. A fully buffered file is written when the
+// buffer fills or on fflush, a line buffered one also after each newline,
+// and an unbuffered one after every call.
+enum {
+	BUF_FULL = 0,
+	BUF_LINE = 1,
+	BUF_NONE = 2,
+}
+
 struct file {
 	a: *alloc;
 	fd: int;
@@ -6,6 +15,8 @@ struct file {
 	w: int;
 	cap: int;
 	eof: int;
+	mode: int;
+	dirty: int;
 }
 
 fopen(fd: int, a: *alloc): *file {
@@ -19,13 +30,45 @@ fopen(fd: int, a: *alloc): *file {
 	f.w = 0;
 	f.cap = 4096;
 	f.eof = 0;
+	f.mode = BUF_FULL;
+	f.dirty = 0;
 
 	f.buf = alloc(a, f.cap);
 
 	return f;
 }
 
+// Set the buffering mode and the size of the buffer. The buffer must be
+// empty if its size changes.
+fsetbuf(f: *file, mode: int, cap: int): void {
+	if (cap <= 0) {
+		die("invalid buffer size");
+	}
+
+	f.mode = mode;
+
+	if (cap == f.cap) {
+		return;
+	}
+
+	if (f.r != f.w) {
+		die("buffer in use");
+	}
+
+	free(f.a, f.buf);
+	f.buf = alloc(f.a, cap);
+	f.cap = cap;
+	f.r = 0;
+	f.w = 0;
+}
+
+// Close the file, first writing out anything still buffered for it. The
+// unread input of a file that is being read is dropped.
 fclose(f: *file): void {
+	if (f.dirty) {
+		fflush(f);
+	}
+
 	if (close(f.fd) != 0) {
 		die("write failed");
 	}
@@ -42,6 +85,7 @@ fflush(f: *file): void {
 		if (f.r == f.w) {
 			f.r = 0;
 			f.w = 0;
+			f.dirty = 0;
 			return;
 		}
 
@@ -91,12 +135,60 @@ fputc(f: *file, ch: int): void {
 
 	f.buf[f.w] = ch: byte;
 	f.w = f.w + 1;
+	f.dirty = 1;
 
-	if (ch == '\n') {
+	if (f.mode == BUF_NONE || (f.mode == BUF_LINE && ch == '\n')) {
 		fflush(f);
 	}
 }
 
+// Write n bytes. A write at least as large as the buffer goes straight to
+// the file after what is already buffered.
+fwrite(f: *file, buf: *byte, n: int): void {
+	var ret: int;
+	var i: int;
+
+	if (n > f.cap - f.w) {
+		fflush(f);
+	}
+
+	if (n >= f.cap) {
+		i = 0;
+		loop {
+			if (i == n) {
+				return;
+			}
+
+			ret = write(f.fd, &buf[i], n - i);
+			if (ret < 0) {
+				die("write failed");
+			}
+
+			i = i + ret;
+		}
+	}
+
+	memcpy(&f.buf[f.w], buf, n);
+	f.w = f.w + n;
+	f.dirty = 1;
+
+	if (f.mode == BUF_NONE) {
+		fflush(f);
+	} else if (f.mode == BUF_LINE) {
+		i = 0;
+		loop {
+			if (i == n) {
+				break;
+			}
+			if (buf[i] == '\n':byte) {
+				fflush(f);
+				break;
+			}
+			i = i + 1;
+		}
+	}
+}
+
 fgetc(f: *file): int {
 	var ch: int;
 
@@ -115,6 +207,72 @@ fgetc(f: *file): int {
 	return ch;
 }
 
+// Read up to n bytes, returning fewer only at the end of the file. Once the
+// buffer is drained, a large read goes straight into buf.
+fread(f: *file, buf: *byte, n: int): int {
+	var i: int;
+	var k: int;
+	var ret: int;
+
+	i = 0;
+	loop {
+		if (i == n) {
+			return i;
+		}
+
+		if (f.r == f.w) {
+			if (f.eof) {
+				return i;
+			}
+
+			if (n - i >= f.cap) {
+				ret = read(f.fd, &buf[i], n - i);
+				if (ret < 0) {
+					die("read failed");
+				}
+				if (ret == 0) {
+					f.eof = 1;
+				}
+				i = i + ret;
+				continue;
+			}
+
+			ffill(f);
+			continue;
+		}
+
+		k = f.w - f.r;
+		if (k > n - i) {
+			k = n - i;
+		}
+
+		memcpy(&buf[i], &f.buf[f.r], k);
+		f.r = f.r + k;
+		i = i + k;
+	}
+}
+
+// Return the buffered input without consuming it, reading more if there is
+// none. *n is set to the number of bytes, which is 0 only at the end of the
+// file. Call fconsume to move past the bytes that were used.
+fpeek(f: *file, n: *int): *byte {
+	if (f.r == f.w) {
+		ffill(f);
+	}
+
+	*n = f.w - f.r;
+
+	return &f.buf[f.r];
+}
+
+fconsume(f: *file, n: int): void {
+	if (n < 0 || n > f.w - f.r) {
+		die("invalid consume");
+	}
+
+	f.r = f.r + n;
+}
+
 fgets(f: *file, buf: *byte, len: int): int {
 	var i: int;
 	var c: int;
@@ -143,13 +301,24 @@ fgets(f: *file, buf: *byte, len: int): int {
 }
 
 fputs(f: *file, s: *byte) {
-	var i: int;
-	i = 0;
-	loop {
-		if !s[i] {
-			break;
-		}
-		fputc(f, s[i]:int);
-		i = i + 1;
+	fwrite(f, s, strlen(s));
+}
+
+fputd(f: *file, n: int) {
+	var a: int;
+
+	if (n < 0) {
+		fputc(f, '-');
+		a = -(n % 10);
+		n = n / -10;
+	} else {
+		a = n % 10;
+		n = n / 10;
+	}
+
+	if (n != 0) {
+		fputd(f, n);
 	}
+
+	fputc(f, '0' + a);
 }
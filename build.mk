@@ -0,0 +1,19 @@
+# Userland programs built by ./mk; see build.sh for the rest.
+
+CC = ./cc2 -cache .cache
+LIBS = bufio.c lib.c alloc.c syscall.c
+CRYPTO = ed25519.c sha512.c sha256.c chacha20.c poly1305.c
+
+echo: $LIBS echo.c
+cmp: $LIBS cmp.c
+rm: $LIBS rm.c
+mv: $LIBS mv.c
+mkdir: $LIBS mkdir.c
+ls: $LIBS ls.c
+cat: $LIBS cat.c
+xxd: $LIBS xxd.c
+cpio: $LIBS cpio.c
+sh: $LIBS sh.c
+sshd: $LIBS $CRYPTO sshd.c
+membench: $LIBS membench.c
+lexbench: $LIBS lexbench.c lex3.c
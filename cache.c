@@ -0,0 +1,454 @@
+// Output cache keyed by the SHA-256 of the compiler binary, the flags and
+// the contents of the source files. A hit copies the stored ELF into place
+// without parsing anything.
+
+struct cache {
+	a: *alloc;
+	dir: *byte;
+
+	// Digest of the compiler, flags and sources
+	key: _sha256_digest;
+
+	// The key extended with the contents of _include'd files
+	ctx: sha256_ctx;
+	ninc: int;
+
+	// Names of _include'd files are recorded next to the key
+	manifest: *byte;
+	mfd: int;
+
+	// Set when the manifest could not be written, so nothing is stored
+	failed: int;
+}
+
+// Format dir/<hex digest>
+cache_name(dir: *byte, digest: *byte, a: *alloc): *byte {
+	var path: *byte;
+	var dlen: int;
+	var i: int;
+	var x: int;
+
+	dlen = strlen(dir);
+	path = alloc(a, dlen + 1 + 64 + 1);
+	memcpy(path, dir, dlen);
+	path[dlen] = '/':byte;
+
+	i = 0;
+	loop {
+		if i == 32 {
+			break;
+		}
+		x = digest[i]:int;
+		path[dlen + 1 + 2 * i] = "0123456789abcdef"[(x >> 4) & 15];
+		path[dlen + 2 + 2 * i] = "0123456789abcdef"[x & 15];
+		i = i + 1;
+	}
+
+	path[dlen + 1 + 64] = 0:byte;
+
+	return path;
+}
+
+// Write a file by way of a temporary so that a concurrent reader never sees
+// a partial file. Returns 0 if it could not be written. The cache is only an
+// optimization, so callers carry on without it.
+cache_write(dst: *byte, buf: *byte, len: int, a: *alloc): int {
+	var fd: int;
+	var off: int;
+	var ret: int;
+	var tmp: *byte;
+
+	tmp = cache_suffix(dst, ".tmp", a);
+
+	unlink(tmp);
+
+	fd = open(tmp, O_CREAT | O_WRONLY, (7 << 6) + (7 << 3) + 7);
+	if fd < 0 {
+		free(a, tmp);
+		return 0;
+	}
+
+	off = 0;
+	loop {
+		if off == len {
+			break;
+		}
+
+		ret = write(fd, &buf[off], len - off);
+		if ret <= 0 {
+			close(fd);
+			unlink(tmp);
+			free(a, tmp);
+			return 0;
+		}
+
+		off = off + ret;
+	}
+
+	close(fd);
+
+	if rename(tmp, dst) != 0 {
+		unlink(tmp);
+		free(a, tmp);
+		return 0;
+	}
+
+	free(a, tmp);
+
+	return 1;
+}
+
+// Copy src to dst. Returns 0 if src cannot be read or dst written.
+cache_copy(src: *byte, dst: *byte, a: *alloc): int {
+	var fd: int;
+	var buf: *byte;
+	var len: int;
+	var ok: int;
+
+	fd = open(src, O_RDONLY, 0);
+	if fd < 0 {
+		return 0;
+	}
+
+	buf = readall(fd, &len, a);
+	close(fd);
+
+	ok = cache_write(dst, buf, len, a);
+
+	free(a, buf);
+
+	return ok;
+}
+
+cache_hash_file(ctx: *sha256_ctx, name: *byte, a: *alloc): int {
+	var fd: int;
+	var buf: *byte;
+	var len: int;
+
+	fd = open(name, O_RDONLY, 0);
+	if fd < 0 {
+		return 0;
+	}
+
+	buf = readall(fd, &len, a);
+	close(fd);
+
+	sha256_update(ctx, (&len):*byte, 8);
+	sha256_update(ctx, buf, len);
+
+	free(a, buf);
+
+	return 1;
+}
+
+cache_hash_str(ctx: *sha256_ctx, s: *byte) {
+	sha256_update(ctx, s, strlen(s) + 1);
+}
+
+// Hash a large file that rarely changes, like the compiler binary or an
+// _include'd archive. Hashing those costs more than compiling a small
+// program, so the digest is remembered in the cache under the identity of
+// the file (device, inode, size and modification time).
+cache_hash_stable(ctx: *sha256_ctx, name: *byte, dir: *byte, a: *alloc): int {
+	var st: stat;
+	var idctx: sha256_ctx;
+	var _digest: _sha256_digest;
+	var digest: *byte;
+	var path: *byte;
+	var fd: int;
+	var buf: *byte;
+	var len: int;
+
+	digest = (&_digest):*byte;
+
+	fd = open(name, O_RDONLY, 0);
+	if fd < 0 {
+		return 0;
+	}
+
+	if fstat(fd, (&st):*byte) < 0 {
+		close(fd);
+		return 0;
+	}
+
+	sha256_init(&idctx);
+	cache_hash_str(&idctx, "stat");
+	sha256_update(&idctx, (&st.dev):*byte, 8);
+	sha256_update(&idctx, (&st.ino):*byte, 8);
+	sha256_update(&idctx, (&st.size):*byte, 8);
+	sha256_update(&idctx, (&st.mtime):*byte, 8);
+	sha256_update(&idctx, (&st.mtime_nsec):*byte, 8);
+	sha256_final(digest, &idctx);
+
+	path = cache_name(dir, digest, a);
+
+	if cache_hash_file(ctx, path, a) {
+		close(fd);
+		free(a, path);
+		return 1;
+	}
+
+	buf = readall(fd, &len, a);
+	close(fd);
+
+	sha256(digest, buf, len);
+	cache_write(path, digest, 32, a);
+
+	len = 32;
+	sha256_update(ctx, (&len):*byte, 8);
+	sha256_update(ctx, digest, 32);
+
+	free(a, buf);
+	free(a, path);
+
+	return 1;
+}
+
+// Compute the cache key for this invocation. Returns 0 when a source file
+// cannot be read, which leaves the error to the compiler, or when the
+// compiler itself cannot be read, as when it was found through PATH. The
+// caller then compiles without the cache.
+cache_open(dir: *byte, argc: int, argv: **byte, a: *alloc): *cache {
+	var c: *cache;
+	var ctx: sha256_ctx;
+	var i: int;
+
+	sha256_init(&ctx);
+
+	if !cache_hash_stable(&ctx, argv[0], dir, a) {
+		return 0:*cache;
+	}
+
+	i = 1;
+	loop {
+		if i >= argc {
+			break;
+		}
+
+		if !strcmp(argv[i], "-o") || !strcmp(argv[i], "-cache") {
+			i = i + 2;
+			continue;
+		}
+
+		if argv[i][0] == '-':byte {
+			cache_hash_str(&ctx, argv[i]);
+			if !strcmp(argv[i], "-C") && i + 1 < argc {
+				i = i + 1;
+				cache_hash_str(&ctx, argv[i]);
+			}
+		} else {
+			cache_hash_str(&ctx, "");
+			if !cache_hash_file(&ctx, argv[i], a) {
+				return 0:*cache;
+			}
+		}
+
+		i = i + 1;
+	}
+
+	c = alloc(a, sizeof(*c)): *cache;
+
+	c.a = a;
+	c.dir = dir;
+	sha256_final((&c.key):*byte, &ctx);
+
+	sha256_init(&c.ctx);
+	sha256_update(&c.ctx, (&c.key):*byte, 32);
+	c.ninc = 0;
+
+	c.manifest = cache_name(dir, (&c.key):*byte, a);
+	c.manifest = cache_suffix(c.manifest, ".inc", a);
+	c.mfd = -1;
+	c.failed = 0;
+
+	return c;
+}
+
+cache_suffix(name: *byte, suffix: *byte, a: *alloc): *byte {
+	var ret: *byte;
+	var n: int;
+	var m: int;
+
+	n = strlen(name);
+	m = strlen(suffix);
+
+	ret = alloc(a, n + m + 1);
+	memcpy(ret, name, n);
+	memcpy(&ret[n], suffix, m + 1);
+
+	return ret;
+}
+
+// Find the entry for the output, hashing the files listed in the manifest
+// if the sources _include anything.
+cache_entry(c: *cache, a: *alloc): *byte {
+	var _digest: _sha256_digest;
+	var digest: *byte;
+	var ctx: sha256_ctx;
+	var fd: int;
+	var buf: *byte;
+	var len: int;
+	var i: int;
+	var j: int;
+
+	digest = (&_digest):*byte;
+
+	fd = open(c.manifest, O_RDONLY, 0);
+	if fd < 0 {
+		return cache_name(c.dir, (&c.key):*byte, a);
+	}
+
+	buf = readall(fd, &len, a);
+	close(fd);
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, (&c.key):*byte, 32);
+
+	i = 0;
+	loop {
+		if i >= len {
+			break;
+		}
+
+		j = i;
+		loop {
+			if j == len || buf[j] == '\n':byte {
+				break;
+			}
+			j = j + 1;
+		}
+
+		if j == len {
+			return 0:*byte;
+		}
+
+		buf[j] = 0:byte;
+		if !cache_hash_stable(&ctx, &buf[i], c.dir, a) {
+			return 0:*byte;
+		}
+
+		i = j + 1;
+	}
+
+	sha256_final(digest, &ctx);
+
+	free(a, buf);
+
+	return cache_name(c.dir, digest, a);
+}
+
+// Copy a cached output into place. An output that already matches is not
+// rewritten, but its timestamp is brought up to date so that mk sees it as
+// newer than the sources that were just compiled.
+cache_fetch(c: *cache, output: *byte): int {
+	var path: *byte;
+	var fd: int;
+	var buf: *byte;
+	var len: int;
+	var old: *byte;
+	var olen: int;
+
+	path = cache_entry(c, c.a);
+	if !path {
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY, 0);
+	if fd < 0 {
+		return 0;
+	}
+
+	buf = readall(fd, &len, c.a);
+	close(fd);
+
+	fd = open(output, O_RDONLY, 0);
+	if fd >= 0 {
+		old = readall(fd, &olen, c.a);
+
+		if olen == len && !memcmp(old, buf, len)
+				&& futimens(fd, 0:*timespec) == 0 {
+			close(fd);
+			free(c.a, old);
+			free(c.a, buf);
+			return 1;
+		}
+
+		close(fd);
+		free(c.a, old);
+	}
+
+	if !cache_write(output, buf, len, c.a) {
+		free(c.a, buf);
+		return 0;
+	}
+
+	free(c.a, buf);
+
+	return 1;
+}
+
+// Record a file pulled in by _include
+cache_include(c: *cache, name: *byte) {
+	var tmp: *byte;
+
+	if c.failed {
+		return;
+	}
+
+	if !cache_hash_stable(&c.ctx, name, c.dir, c.a) {
+		c.failed = 1;
+		return;
+	}
+
+	if c.mfd < 0 {
+		tmp = cache_suffix(c.manifest, ".tmp", c.a);
+		unlink(tmp);
+		c.mfd = open(tmp, O_CREAT | O_WRONLY, (6 << 6) + (6 << 3) + 6);
+		if c.mfd < 0 {
+			c.failed = 1;
+			return;
+		}
+	}
+
+	fdputs(c.mfd, name);
+	fdputs(c.mfd, "\n");
+
+	c.ninc = c.ninc + 1;
+}
+
+// Save the output under the key, and the manifest if there is one. Nothing
+// is saved if the manifest could not be written.
+cache_store(c: *cache, output: *byte) {
+	var _digest: _sha256_digest;
+	var digest: *byte;
+	var path: *byte;
+	var tmp: *byte;
+
+	digest = (&_digest):*byte;
+
+	if c.failed {
+		if c.mfd >= 0 {
+			close(c.mfd);
+			c.mfd = -1;
+			unlink(cache_suffix(c.manifest, ".tmp", c.a));
+		}
+		return;
+	}
+
+	if c.ninc == 0 {
+		path = cache_name(c.dir, (&c.key):*byte, c.a);
+		cache_copy(output, path, c.a);
+		return;
+	}
+
+	sha256_final(digest, &c.ctx);
+	path = cache_name(c.dir, digest, c.a);
+
+	close(c.mfd);
+	c.mfd = -1;
+
+	tmp = cache_suffix(c.manifest, ".tmp", c.a);
+	if !cache_copy(output, path, c.a) || rename(tmp, c.manifest) != 0 {
+		unlink(tmp);
+	}
+}
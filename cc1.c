@@ -33,6 +33,11 @@ struct decl {
 	goto_label: *label;
 }
 
+// An entry in the file table, which source locations refer to by index
+struct srcfile {
+	name: *byte;
+}
+
 struct compiler {
 	// Allocator
 	a: *alloc;
@@ -40,12 +45,24 @@ struct compiler {
 	// Lexer
 	in: *file;
 	nc: int;
+	pos: int;
+	src: *byte;
+	srclen: int;
+	srcmapped: int;
 	filename: *byte;
+	fileno: int;
+	files: *srcfile;
+	nfiles: int;
+	fcap: int;
 	lineno: int;
 	colno: int;
 	tt: int;
+
+	// The text of the current token is token[0:tlen]. It is either in
+	// tbuf or, for a front end that scans from memory, in the source.
 	token: *byte;
 	tlen: int;
+	tbuf: *byte;
 	tmax: int;
 
 	// Assembler
@@ -53,6 +70,10 @@ struct compiler {
 
 	// Namespace
 	decls: *decl;
+	locals: *decl;
+
+	// Output cache
+	cache: *cache;
 }
 
 show_context(c: *compiler) {
@@ -75,8 +96,46 @@ cdie(c: *compiler, msg: *byte) {
 	exit(1);
 }
 
+// Add a name to the file table, which lets a node refer to its source file
+// with a small index instead of a pointer.
+add_file(c: *compiler, filename: *byte): int {
+	var files: *srcfile;
+	var f: *srcfile;
+
+	if (c.nfiles == c.fcap) {
+		files = alloc(c.a, 2 * c.fcap * sizeof(*files)): *srcfile;
+		memcpy(files: *byte, c.files: *byte, c.nfiles * sizeof(*files));
+		free(c.a, c.files: *byte);
+		c.files = files;
+		c.fcap = 2 * c.fcap;
+	}
+
+	if (c.nfiles >= 0x7fff) {
+		cdie(c, "too many files");
+	}
+
+	f = &c.files[c.nfiles];
+	f.name = filename;
+	c.nfiles = c.nfiles + 1;
+
+	return c.nfiles - 1;
+}
+
+// Pack the current position as file index, line and column
+mkloc(c: *compiler): int {
+	return (c.fileno << 48) | ((c.lineno & 0xffffff) << 24) | (c.colno & 0xffffff);
+}
+
+set_loc(c: *compiler, loc: int) {
+	c.fileno = loc >> 48;
+	c.filename = c.files[c.fileno].name;
+	c.lineno = (loc >> 24) & 0xffffff;
+	c.colno = loc & 0xffffff;
+}
+
 comp_setup(a: *alloc): *compiler {
 	var c: *compiler;
+	var asa: *alloc;
 
 	c = alloc(a, sizeof(*c)): *compiler;
 
@@ -84,17 +143,33 @@ comp_setup(a: *alloc): *compiler {
 
 	c.in = 0: *file;
 	c.nc = 0;
+	c.src = 0:*byte;
+	c.srclen = 0;
+	c.srcmapped = 0;
 	c.filename = 0:*byte;
+	c.fileno = 0;
+	c.nfiles = 0;
+	c.fcap = 16;
+	c.files = alloc(c.a, c.fcap * sizeof(*c.files)): *srcfile;
 	c.lineno = 1;
 	c.colno = 1;
+	c.pos = 0;
 	c.tlen = 0;
 	c.tmax = 4096;
-	c.token = alloc(c.a, c.tmax);
+	c.tbuf = alloc(c.a, c.tmax);
+	c.token = c.tbuf;
 	c.tt = 0;
 
-	c.as = setup_assembler(a);
+	// The assembler gets its own allocator so that code, labels and
+	// fixups survive when a function's region is released.
+	asa = alloc(a, sizeof(*asa)): *alloc;
+	setup_alloc(asa);
+	c.as = setup_assembler(asa);
 
 	c.decls = 0:*decl;
+	c.locals = 0:*decl;
+
+	c.cache = 0:*cache;
 
 	return c;
 }
@@ -303,12 +378,22 @@ compile_func(c: *compiler, d: *decl) {
 	var t: *type;
 	var offset: int;
 	var n: *node;
+	var body: *node;
 	var pragma: int;
+	var mark: *alloc_mark;
 
 	if (!d.func_def) {
 		return;
 	}
 
+	// Arguments, locals, labels and the types worked out for the body live
+	// in a region that is dropped once the code has been emitted. The body
+	// is not looked at again after that.
+	mark = alloc_mark(c.a);
+	c.locals = 0:*decl;
+
+	body = d.func_def.b;
+
 	n = d.func_def.a.b.a;
 	offset = 16;
 	loop {
@@ -319,7 +404,7 @@ compile_func(c: *compiler, d: *decl) {
 		name = n.a.a.s;
 		t = prototype(c, n.a.b);
 
-		v = find(c, d.name, name, 1);
+		v = find_local(c, name, 1);
 		if (v.var_defined) {
 			cdie(c, "duplicate argument");
 		}
@@ -334,7 +419,7 @@ compile_func(c: *compiler, d: *decl) {
 	}
 
 	// Hoist locals
-	offset = hoist_locals(c, d, d.func_def.b, 0);
+	offset = hoist_locals(c, d, body, 0);
 
 	if (!strcmp(d.name, "_start")) {
 		pragma = 1;
@@ -348,7 +433,7 @@ compile_func(c: *compiler, d: *decl) {
 	emit_str(c.as, d.name);
 	fixup_label(c.as, d.func_label);
 	emit_preamble(c.as, offset, pragma);
-	compile_stmt(c, d, d.func_def.b, 0:*label, 0:*label);
+	compile_stmt(c, d, body, 0:*label, 0:*label);
 	emit_num(c.as, 0);
 
 	if (pragma) {
@@ -356,6 +441,9 @@ compile_func(c: *compiler, d: *decl) {
 	}
 
 	emit_ret(c.as);
+
+	c.locals = 0:*decl;
+	alloc_release(c.a, mark);
 }
 
 hoist_locals(c: *compiler, d: *decl, n: *node, offset: int): int {
@@ -393,7 +481,7 @@ hoist_locals(c: *compiler, d: *decl, n: *node, offset: int): int {
 		return hoist_locals(c, d, n.a, offset);
 	} else if (kind == N_LABEL) {
 		name = n.a.s;
-		v = find(c, d.name, name, 1);
+		v = find_local(c, name, 1);
 
 		if (v.goto_defined) {
 			cdie(c, "duplicate goto");
@@ -408,7 +496,7 @@ hoist_locals(c: *compiler, d: *decl, n: *node, offset: int): int {
 	name = n.a.s;
 	t = prototype(c, n.b);
 
-	v = find(c, d.name, name, 1);
+	v = find_local(c, name, 1);
 
 	if (v.var_defined) {
 		cdie(c, "duplicate variable");
@@ -429,6 +517,7 @@ compile_include(c: *compiler, n: *node) {
 	var fd: int;
 	var blob: *byte;
 	var len: int;
+	var mapped: int;
 
 	if n.b.a.kind != N_STR {
 		die("non literal include");
@@ -441,17 +530,31 @@ compile_include(c: *compiler, n: *node) {
 		die("failed to open include");
 	}
 
-	blob = readall(fd, &len, c.a);
+	// The initramfs can be large, so map it rather than copy it twice
+	mapped = 1;
+	blob = mapfile(fd, &len);
+	if (!blob) {
+		mapped = 0;
+		blob = readall(fd, &len, c.a);
+	}
 
 	close(fd);
 
+	if (c.cache) {
+		cache_include(c.cache, filename);
+	}
+
 	as_opr(c.as, OP_POPR, R_RAX);
 	as_opr(c.as, OP_POPR, R_RDI);
 	as_opri64(c.as, OP_MOVABS, R_RAX, len);
 	as_modrm(c.as, OP_STORE, R_RAX, R_RDI, 0, 0, 0);
 	emit_blob(c.as, blob, len);
 
-	free(c.a, blob);
+	if (mapped) {
+		unmapfile(blob, len);
+	} else {
+		free(c.a, blob);
+	}
 }
 
 // Translate an expression
@@ -461,8 +564,7 @@ compile_expr(c: *compiler, d: *decl, n: *node, rhs: int) {
 	var v: *decl;
 	var kind: int;
 
-	c.filename = n.filename;
-	c.lineno = n.lineno;
+	set_loc(c, n.loc);
 	c.colno = 0;
 
 	kind = n.kind;
@@ -521,7 +623,7 @@ compile_expr(c: *compiler, d: *decl, n: *node, rhs: int) {
 				cdie(c, "type error");
 			}
 
-			v = find(c, d.name, n.a.s, 0);
+			v = find_local(c, n.a.s, 0);
 			if (v && v.var_defined) {
 				emit_lea(c.as, v.var_offset);
 				n.a.t = v.var_type;
@@ -597,7 +699,7 @@ compile_expr(c: *compiler, d: *decl, n: *node, rhs: int) {
 			return;
 		}
 
-		v = find(c, d.name, n.s, 0);
+		v = find_local(c, n.s, 0);
 		if (v && v.var_defined) {
 			emit_lea(c.as, v.var_offset);
 			n.t = v.var_type;
@@ -1103,8 +1205,7 @@ compile_stmt(c: *compiler, d: *decl, n: *node, top: *label, out: *label) {
 		return;
 	}
 
-	c.filename = n.filename;
-	c.lineno = n.lineno;
+	set_loc(c, n.loc);
 	c.colno = 0;
 
 	kind = n.kind;
@@ -1173,10 +1274,10 @@ compile_stmt(c: *compiler, d: *decl, n: *node, top: *label, out: *label) {
 		}
 		emit_ret(c.as);
 	} else if (kind == N_LABEL) {
-		v = find(c, d.name, n.a.s, 0);
+		v = find_local(c, n.a.s, 0);
 		fixup_label(c.as, v.goto_label);
 	} else if (kind == N_GOTO) {
-		v = find(c, d.name, n.a.s, 0);
+		v = find_local(c, n.a.s, 0);
 		if (!v || !v.goto_defined) {
 			cdie(c, "label not defined");
 		}
@@ -1188,13 +1289,22 @@ compile_stmt(c: *compiler, d: *decl, n: *node, top: *label, out: *label) {
 }
 
 find(c: *compiler, name: *byte, member_name: *byte, make: int): *decl {
+	return find_in(c, &c.decls, name, member_name, make);
+}
+
+// Find a variable or label of the function being compiled
+find_local(c: *compiler, name: *byte, make: int): *decl {
+	return find_in(c, &c.locals, name, 0:*byte, make);
+}
+
+find_in(c: *compiler, root: **decl, name: *byte, member_name: *byte, make: int): *decl {
 	var p: *decl;
 	var d: *decl;
 	var link: **decl;
 	var dir: int;
 
 	p = 0: *decl;
-	link = &c.decls;
+	link = root;
 	loop {
 		d = *link;
 		if (!d) {
@@ -1553,6 +1663,63 @@ emit_isr(c: *compiler) {
 	as_op(c.as, OP_IRETQ);
 }
 
+// Scan the sources without parsing them and report the token rate. This
+// compares front ends, as cc1 can be built with either lex1.c or lex2.c.
+scan_sources(c: *compiler, argc: int, argv: **byte) {
+	var ts: timespec;
+	var start: int;
+	var elapsed: int;
+	var n: int;
+	var i: int;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.sec * 1000000000 + ts.nsec;
+
+	n = 0;
+	i = 1;
+	loop {
+		if (i >= argc) {
+			break;
+		}
+
+		if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "-cache")
+				|| !strcmp(argv[i], "-map") || !strcmp(argv[i], "-C")) {
+			i = i + 2;
+			continue;
+		}
+
+		if (argv[i][0] == '-':byte) {
+			i = i + 1;
+			continue;
+		}
+
+		open_source(c, argv[i]);
+		loop {
+			if (c.tt == T_EOF) {
+				break;
+			}
+			n = n + 1;
+			feed(c);
+		}
+		close_source(c);
+
+		i = i + 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = (ts.sec * 1000000000 + ts.nsec - start) / 1000;
+	if (elapsed <= 0) {
+		elapsed = 1;
+	}
+
+	fdputd(1, n);
+	fdputs(1, " tokens in ");
+	fdputd(1, elapsed);
+	fdputs(1, " us, ");
+	fdputd(1, n * 1000000 / elapsed);
+	fdputs(1, " tokens/s\n");
+}
+
 main(argc: int, argv: **byte, envp: **byte) {
 	var a: alloc;
 	var c: *compiler;
@@ -1561,11 +1728,70 @@ main(argc: int, argv: **byte, envp: **byte) {
 	var start: *label;
 	var kstart: *label;
 	var i: int;
+	var output: *byte;
+	var dir: *byte;
+	var map: *byte;
 
 	setup_alloc(&a);
 
 	c = comp_setup(&a);
 
+	output = "a.out";
+	dir = 0:*byte;
+	map = 0:*byte;
+
+	i = 1;
+	loop {
+		if (i >= argc) {
+			break;
+		}
+
+		if (!strcmp(argv[i], "-o")) {
+			if (i + 1 >= argc) {
+				die("invalid -o at end of argument list");
+			}
+			output = argv[i + 1];
+		} else if (!strcmp(argv[i], "-cache")) {
+			if (i + 1 >= argc) {
+				die("invalid -cache at end of argument list");
+			}
+			dir = argv[i + 1];
+		} else if (!strcmp(argv[i], "-map")) {
+			if (i + 1 >= argc) {
+				die("invalid -map at end of argument list");
+			}
+			map = argv[i + 1];
+		} else if (!strcmp(argv[i], "-tokens")) {
+			scan_sources(c, argc, argv);
+			return;
+		}
+
+		i = i + 1;
+	}
+
+	// Reuse a previous output when nothing that goes into it has changed.
+	// The cache does not keep perf maps, so -map always compiles.
+	if (dir && !map) {
+		c.cache = cache_open(dir, argc, argv, &a);
+	}
+
+	if (c.cache) {
+		if (cache_fetch(c.cache, output)) {
+			fdputs(2, "cache hit ");
+			fdputs(2, output);
+			fdputs(2, "\n");
+			return;
+		}
+	}
+
+	// A cache that could not compute a key, as when the compiler binary
+	// cannot be read, reports a miss and is not used.
+	if (dir && !map) {
+		fdputs(2, "cache miss ");
+		fdputs(2, output);
+		fdputs(2, "\n");
+	}
+
 	i = 1;
 	loop {
 		if (i >= argc) {
@@ -1582,6 +1808,17 @@ main(argc: int, argv: **byte, envp: **byte) {
 			continue;
 		}
 
+		if (!strcmp(argv[i], "-cache") || !strcmp(argv[i], "-map")) {
+			i = i + 2;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "-g")) {
+			c.as.symtab = 1;
+			i = i + 1;
+			continue;
+		}
+
 		if (!strcmp(argv[i], "-C")) {
 			i = i + 1;
 			if (i >= argc) {
@@ -1754,6 +1991,18 @@ main(argc: int, argv: **byte, envp: **byte) {
 		emit_ret(c.as);
 	}
 
+	d = find(c, "rdtsc", 0:*byte, 1);
+	if (d.func_defined && !d.func_label.fixed) {
+		fixup_label(c.as, d.func_label);
+		emit_preamble(c.as, 0, 0);
+		as_op(c.as, OP_RDTSC);
+		as_modri(c.as, OP_MOVI, R_RCX, 32);
+		as_modr(c.as, OP_SHLM, R_RDX);
+		as_modrr(c.as, OP_ORRM, R_RAX, R_RDX);
+		as_opr(c.as, OP_PUSHR, R_RAX);
+		emit_ret(c.as);
+	}
+
 	d = find(c, "rdcr0", 0:*byte, 1);
 	if (d.func_defined && !d.func_label.fixed) {
 		fixup_label(c.as, d.func_label);
@@ -2169,5 +2418,29 @@ main(argc: int, argv: **byte, envp: **byte) {
 		kstart = d.func_label;
 	}
 
+	if (c.as.symtab || map) {
+		d = first_decl(c);
+		loop {
+			if (!d) {
+				break;
+			}
+
+			if (d.func_defined && d.func_label.fixed) {
+				as_symbol(c.as, d.name, d.func_label.at);
+			}
+
+			d = next_decl(c, d);
+		}
+	}
+
 	writeout(c.as, start, kstart);
+
+	if (map) {
+		write_perfmap(c.as, map);
+	}
+
+	if (c.cache) {
+		close_output(c.as);
+		cache_store(c.cache, output);
+	}
 }
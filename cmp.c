@@ -4,8 +4,13 @@ main(argc: int, argv: **byte, envp: **byte) {
 	var alloc: alloc;
 	var fa: *file;
 	var fb: *file;
-	var c: int;
+	var pa: *byte;
+	var pb: *byte;
+	var na: int;
+	var nb: int;
+	var n: int;
 	var i: int;
+	var j: int;
 
 	setup_alloc(&alloc);
 
@@ -32,25 +37,52 @@ main(argc: int, argv: **byte, envp: **byte) {
 	fa = fopen(a, &alloc);
 	fb = fopen(b, &alloc);
 
+	fsetbuf(fa, BUF_FULL, 64 * 1024);
+	fsetbuf(fb, BUF_FULL, 64 * 1024);
+
+	// Compare whatever both buffers hold at once and only look for the
+	// exact byte once a block differs.
 	i = 0;
 	loop {
-		c = fgetc(fa);
-
-		if c != fgetc(fb) {
-			fdputs(1, argv[1]);
-			fdputc(1, ' ');
-			fdputs(1, argv[2]);
-			fdputc(1, ' ');
-			fdputs(1, "differ: byte ");
-			fdputd(1, i);
-			fdputc(1, '\n');
-			exit(1);
+		pa = fpeek(fa, &na);
+		pb = fpeek(fb, &nb);
+
+		n = na;
+		if nb < n {
+			n = nb;
 		}
 
-		if c == -1 {
+		if n == 0 {
+			if na != nb {
+				differ(argv[1], argv[2], i);
+			}
 			break;
 		}
 
-		i = i + 1;
+		if memcmp(pa, pb, n) {
+			j = 0;
+			loop {
+				if pa[j] != pb[j] {
+					break;
+				}
+				j = j + 1;
+			}
+			differ(argv[1], argv[2], i + j);
+		}
+
+		fconsume(fa, n);
+		fconsume(fb, n);
+		i = i + n;
 	}
 }
+
+differ(a: *byte, b: *byte, i: int) {
+	fdputs(1, a);
+	fdputc(1, ' ');
+	fdputs(1, b);
+	fdputc(1, ' ');
+	fdputs(1, "differ: byte ");
+	fdputd(1, i);
+	fdputc(1, '\n');
+	exit(1);
+}
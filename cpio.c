@@ -1,24 +1,7 @@
-struct stat {
-	dev: int;
-	ino: int;
-	nlink: int;
-	uid_mode: int;
-	gid: int;
-	rdev: int;
-	size: int;
-	blksize: int;
-	blocks: int;
-	atime: int;
-	atime_nsec: int;
-	mtime: int;
-	mtime_nsec: int;
-	ctime: int;
-	ctime_nsec: int;
-	pad0: int;
-	pad1: int;
-	pad2: int;
-}
-
+// cpio -o writes the files named on stdin as a newc archive. With -a, the
+// data of each file starts on a 4K boundary of the archive, so that it can
+// be mapped in place. The gap is filled by padding the name with NULs,
+// which readers drop along with the terminator.
 main(argc: int, argv: **byte, envp: **byte) {
 	var opts: int;
 	var i: int;
@@ -31,12 +14,13 @@ main(argc: int, argv: **byte, envp: **byte) {
 	var buf: *byte;
 	var len: int;
 	var n: int;
-	var m: int;
 	var k: int;
-	var ret: int;
+	var off: int;
+	var namesize: int;
 
 	setup_alloc(&a);
 
+	opts = 0;
 	i = 1;
 	loop {
 		if i >= argc {
@@ -45,6 +29,8 @@ main(argc: int, argv: **byte, envp: **byte) {
 
 		if !strcmp(argv[i], "-o") {
 			opts = opts | 1;
+		} else if !strcmp(argv[i], "-a") {
+			opts = opts | 2;
 		} else {
 			die("invalid argument");
 		}
@@ -54,9 +40,12 @@ main(argc: int, argv: **byte, envp: **byte) {
 
 	stdin = fopen(0, &a);
 	stdout = fopen(1, &a);
+	fsetbuf(stdout, BUF_FULL, 64 * 1024);
 
 	name = alloc(&a, 4096);
-	buf = alloc(&a, 4096);
+	buf = alloc(&a, 64 * 1024);
+
+	off = 0;
 
 	loop {
 		if stdin.eof {
@@ -93,6 +82,11 @@ main(argc: int, argv: **byte, envp: **byte) {
 			exit(1);
 		}
 
+		namesize = len + 1;
+		if (opts & 2) && stat.size > 0 {
+			namesize = ((off + 110 + namesize + 4095) & -4096) - off - 110;
+		}
+
 		// header
 		fputs(stdout, "070701");
 		fputh(stdout, stat.ino);
@@ -106,15 +100,22 @@ main(argc: int, argv: **byte, envp: **byte) {
 		fputh(stdout, stat.dev & 255);
 		fputh(stdout, stat.rdev >> 8);
 		fputh(stdout, (stat.rdev) & 255);
-		fputh(stdout, len + 1);
+		fputh(stdout, namesize);
 		fputh(stdout, 0);
 
 		fputs(stdout, name);
-		fputc(stdout, 0);
+		k = len;
+		loop {
+			if k == namesize {
+				break;
+			}
+			fputc(stdout, 0);
+			k = k + 1;
+		}
 
 		// align to four bytes
-		falign(stdout, len + 3);
-		fflush(stdout);
+		falign(stdout, namesize + 2);
+		off = (off + 110 + namesize + 3) & -4;
 
 		// copy data
 		n = 0;
@@ -123,7 +124,7 @@ main(argc: int, argv: **byte, envp: **byte) {
 				break;
 			}
 
-			k = read(fd, buf, 4096);
+			k = read(fd, buf, 64 * 1024);
 			if k <= 0 {
 				die("failed to read");
 			}
@@ -132,26 +133,14 @@ main(argc: int, argv: **byte, envp: **byte) {
 				k = stat.size - n;
 			}
 
-			m = 0;
-			loop {
-				if m == k {
-					break;
-				}
-
-				ret = write(1, &buf[m], k - m);
-				if ret < 0 {
-					die("failed to write");
-				}
-
-				m = m + ret;
-			}
+			fwrite(stdout, buf, k);
 
 			n = n + k;
 		}
 
 		// align to four bytes
 		falign(stdout, stat.size);
-		fflush(stdout);
+		off = (off + stat.size + 3) & -4;
 
 		close(fd);
 	}
@@ -1,28 +1,8 @@
-getchar(): int {
-	var b: byte;
-	var ret: int;
-	ret = read(0, &b, 1);
-	if (ret < 0) {
-		exit(3);
-	}
-	if (ret == 0) {
-		return -1;
-	}
-	return b: int;
-}
-
-putchar(ch: int): void {
-	var b: byte;
-	var ret: int;
-	b = ch: byte;
-	ret = write(1, &b, 1);
-	if (ret != 1) {
-		exit(3);
-	}
-}
-
 struct compiler {
 	a: alloc;
+	tmp: scratch;
+	in: *file;
+	out: *file;
 	nc: int;
 	lineno: int;
 	colno: int;
@@ -34,13 +14,29 @@ struct compiler {
 	tags: *tag;
 	ntags: int;
 	nnfa: int;
+	nfas: *nfa;
 	ndfa: int;
-	d: *dfa;
+	states: **dfa;
+	scap: int;
+	htab: **dfa;
+	hsize: int;
+	classes: *int;
+	rep: *int;
+	nclass: int;
+	first: *int;
+	enext: *int;
+	enode: **nfa;
+	nedge: int;
+	ecap: int;
 }
 
 setup(c: *compiler): void {
 	setup_alloc(&c.a);
-	c.nc = getchar();
+	setup_scratch(&c.tmp);
+	c.in = fopen(0, &c.a);
+	c.out = fopen(1, &c.a);
+	fsetbuf(c.out, BUF_FULL, 64 * 1024);
+	c.nc = fgetc(c.in);
 	c.lineno = 1;
 	c.colno = 1;
 	c.tt = 0;
@@ -51,13 +47,25 @@ setup(c: *compiler): void {
 	c.tags = 0: *tag;
 	c.ntags = 0;
 	c.nnfa = 0;
+	c.nfas = 0:*nfa;
 	c.ndfa = 0;
-	c.d = 0:*dfa;
+	c.states = 0:**dfa;
+	c.scap = 0;
+	c.htab = 0:**dfa;
+	c.hsize = 0;
+	c.classes = 0:*int;
+	c.rep = 0:*int;
+	c.nclass = 0;
+	c.first = 0:*int;
+	c.enext = 0:*int;
+	c.enode = 0:**nfa;
+	c.nedge = 0;
+	c.ecap = 0;
 	feed(c);
 }
 
 feedc(c: *compiler): void {
-	c.nc = getchar();
+	c.nc = fgetc(c.in);
 	if (c.nc == '\n') {
 		c.lineno = c.lineno + 1;
 		c.colno = 0;
@@ -261,7 +269,7 @@ feed_charset(c: *compiler): void {
 	mode = 1;
 	nonempty = 0;
 
-	i = left;
+	i = 0;
 	loop {
 		if (i == 256) {
 			break;
@@ -449,6 +457,7 @@ struct nfa {
 	a: *nfa;
 	b: *nfa;
 	end: *nfa;
+	all: *nfa;
 }
 
 nfa_empty(c: *compiler): *nfa {
@@ -461,6 +470,8 @@ nfa_empty(c: *compiler): *nfa {
 	n.a = 0:*nfa;
 	n.b = 0:*nfa;
 	n.end = n;
+	n.all = c.nfas;
+	c.nfas = n;
 	c.nnfa = c.nnfa + 1;
 	return n;
 }
@@ -717,9 +728,8 @@ struct dfa {
 	id: int;
 	link: **dfa;
 	key: nlist;
-	l: *dfa;
-	r: *dfa;
-	seen: int;
+	hash: int;
+	hnext: *dfa;
 }
 
 struct nlist {
@@ -761,55 +771,46 @@ activate(l: *nlist, n: *nfa): void {
 	}
 }
 
-nlist_cmp(a: *nlist, b: *nlist): int {
+nlist_eq(a: *nlist, b: *nlist): int {
 	var i: int;
 
+	if (a.fill != b.fill || a.tag != b.tag) {
+		return 0;
+	}
+
 	i = 0;
 	loop {
-		if (i == a.fill && i == b.fill) {
-			break;
-		}
-
 		if (i == a.fill) {
-			return -1;
-		}
-
-		if (i == b.fill) {
 			return 1;
 		}
 
-		if (a.live[i].id > b.live[i].id) {
-			return 1;
-		}
-
-		if (a.live[i].id < b.live[i].id) {
-			return -1;
+		if (a.live[i] != b.live[i]) {
+			return 0;
 		}
 
 		i = i + 1;
 	}
+}
 
-	if (!a.tag && !b.tag) {
-		return 0;
-	}
-
-	if (!a.tag) {
-		return -1;
-	}
-
-	if (!b.tag) {
-		return 1;
-	}
+nlist_hash(l: *nlist): int {
+	var h: int;
+	var i: int;
 
-	if (a.tag.id < b.tag.id) {
-		return -1;
+	h = 5381;
+	if (l.tag) {
+		h = h ^ (l.tag.id + 1);
 	}
 
-	if (a.tag.id > b.tag.id) {
-		return 1;
+	i = 0;
+	loop {
+		if (i == l.fill) {
+			break;
+		}
+		h = ((h * 33) ^ l.live[i].id) & 0x7fffffff;
+		i = i + 1;
 	}
 
-	return 0;
+	return h;
 }
 
 nlist_sort(l: *nlist): void {
@@ -866,6 +867,7 @@ nlist_sort(l: *nlist): void {
 			if (tmp.id >= l.live[k].id) {
 				break;
 			}
+			l.live[j] = l.live[k];
 			j = k;
 		}
 		l.live[j] = tmp;
@@ -876,10 +878,10 @@ nlist_sort(l: *nlist): void {
 alloc_link(c: *compiler): **dfa {
 	var link: **dfa;
 	var i: int;
-	link = alloc(&c.a, sizeof(*link) * 256): **dfa;
+	link = alloc(&c.a, sizeof(*link) * c.nclass): **dfa;
 	i = 0;
 	loop {
-		if (i == 256) {
+		if (i == c.nclass) {
 			break;
 		}
 		link[i] = 0:*dfa;
@@ -903,131 +905,777 @@ nlist_copy(c: *compiler, dest: *nlist, src: *nlist): void {
 	}
 }
 
-nlist2dfa(c: *compiler, l: *nlist): *dfa {
-	var link: **dfa;
-	var d: *dfa;
+// Split the bytes into classes that no nfa range tells apart, so that
+// transitions are computed once per class rather than once per byte.
+byte_classes(c: *compiler): void {
+	var edge: *int;
 	var n: *nfa;
-	var t: *tag;
-	var dir: int;
 	var i: int;
-	var j: int;
+	var k: int;
 
-	if (l.fill == 0 && !l.tag) {
-		return 0:*dfa;
+	edge = alloc(&c.tmp.a, sizeof(*edge) * 257):*int;
+	i = 0;
+	loop {
+		if (i == 257) {
+			break;
+		}
+		edge[i] = 0;
+		i = i + 1;
 	}
 
-	link = &c.d;
+	n = c.nfas;
 	loop {
-		d = *link;
-		if (!d) {
+		if (!n) {
 			break;
 		}
+		if (n.left != -1) {
+			edge[n.left] = 1;
+			edge[n.right] = 1;
+		}
+		n = n.all;
+	}
 
-		dir = nlist_cmp(l, &d.key);
+	c.classes = alloc(&c.a, sizeof(*c.classes) * 256):*int;
+	c.rep = alloc(&c.a, sizeof(*c.rep) * 256):*int;
 
-		if (dir < 0) {
-			link = &d.l;
-		} else if (dir > 0) {
-			link = &d.r;
-		} else {
-			return d;
+	k = -1;
+	i = 0;
+	loop {
+		if (i == 256) {
+			break;
+		}
+		if (i == 0 || edge[i]) {
+			k = k + 1;
+			c.rep[k] = i;
 		}
+		c.classes[i] = k;
+		i = i + 1;
+	}
+
+	c.nclass = k + 1;
+
+	scratch_reset(&c.tmp);
+}
+
+grow_states(c: *compiler): void {
+	var states: **dfa;
+	var htab: **dfa;
+	var d: *dfa;
+	var i: int;
+	var cap: int;
+
+	if (c.ndfa < c.scap) {
+		return;
+	}
+
+	cap = c.scap * 2;
+	if (cap == 0) {
+		cap = 64;
+	}
+
+	states = alloc(&c.a, sizeof(*states) * cap):**dfa;
+	htab = alloc(&c.a, sizeof(*htab) * cap):**dfa;
+
+	i = 0;
+	loop {
+		if (i == cap) {
+			break;
+		}
+		htab[i] = 0:*dfa;
+		i = i + 1;
+	}
+
+	i = 0;
+	loop {
+		if (i == c.ndfa) {
+			break;
+		}
+		d = c.states[i];
+		states[i] = d;
+		d.hnext = htab[d.hash & (cap - 1)];
+		htab[d.hash & (cap - 1)] = d;
+		i = i + 1;
 	}
 
+	if (c.states) {
+		free(&c.a, c.states:*byte);
+		free(&c.a, c.htab:*byte);
+	}
+
+	c.states = states;
+	c.htab = htab;
+	c.scap = cap;
+	c.hsize = cap;
+}
+
+// Find the state for a sorted nlist, adding it to the end of the worklist
+// if it is new.
+nlist2dfa(c: *compiler, l: *nlist): *dfa {
+	var d: *dfa;
+	var h: int;
+
+	if (l.fill == 0 && !l.tag) {
+		return 0:*dfa;
+	}
+
+	h = nlist_hash(l);
+
+	if (c.hsize) {
+		d = c.htab[h & (c.hsize - 1)];
+		loop {
+			if (!d) {
+				break;
+			}
+
+			if (d.hash == h && nlist_eq(l, &d.key)) {
+				return d;
+			}
+
+			d = d.hnext;
+		}
+	}
+
+	grow_states(c);
+
 	d = alloc(&c.a, sizeof(*d)): *dfa;
 	d.id = c.ndfa;
 	d.link = alloc_link(c);
 	nlist_copy(c, &d.key, l);
-	d.l = 0: *dfa;
-	d.r = 0: *dfa;
-	d.seen = 0;
+	d.hash = h;
+	d.hnext = c.htab[h & (c.hsize - 1)];
+	c.htab[h & (c.hsize - 1)] = d;
 
+	c.states[c.ndfa] = d;
 	c.ndfa = c.ndfa + 1;
 
-	*link = d;
+	return d;
+}
 
+deactivate(l: *nlist): void {
+	var i: int;
 	i = 0;
 	loop {
-		if (i == 256) {
+		if (i >= l.fill) {
+			l.fill = 0;
+			l.tag = 0: *tag;
+			break;
+		}
+		l.live[i].live = 0;
+		i = i + 1;
+	}
+}
+
+// Keep only the nodes that consume input. The epsilon nodes that led to
+// them do not change where the state goes next, so leaving them out makes
+// keys smaller and lets more of them compare equal.
+nlist_kernel(dest: *nlist, src: *nlist): void {
+	var i: int;
+	var n: *nfa;
+
+	dest.fill = 0;
+	dest.tag = src.tag;
+
+	i = 0;
+	loop {
+		if (i >= src.fill) {
+			break;
+		}
+
+		n = src.live[i];
+		if (n.left != -1) {
+			dest.live[dest.fill] = n;
+			dest.fill = dest.fill + 1;
+		}
+
+		i = i + 1;
+	}
+
+	nlist_sort(dest);
+}
+
+// Note that node n accepts the bytes in class k
+add_edge(c: *compiler, k: int, n: *nfa): void {
+	var enext: *int;
+	var enode: **nfa;
+	var cap: int;
+	var i: int;
+
+	if (c.nedge == c.ecap) {
+		cap = c.ecap * 2;
+		if (cap == 0) {
+			cap = 256;
+		}
+
+		enext = alloc(&c.a, sizeof(*enext) * cap):*int;
+		enode = alloc(&c.a, sizeof(*enode) * cap):**nfa;
+
+		i = 0;
+		loop {
+			if (i == c.nedge) {
+				break;
+			}
+			enext[i] = c.enext[i];
+			enode[i] = c.enode[i];
+			i = i + 1;
+		}
+
+		if (c.enext) {
+			free(&c.a, c.enext:*byte);
+			free(&c.a, c.enode:*byte);
+		}
+
+		c.enext = enext;
+		c.enode = enode;
+		c.ecap = cap;
+	}
+
+	c.enode[c.nedge] = n;
+	c.enext[c.nedge] = c.first[k];
+	c.first[k] = c.nedge;
+	c.nedge = c.nedge + 1;
+}
+
+// Subset construction over byte classes. States are numbered in the order
+// they are found, which is also the order in which they are expanded.
+powerset(c: *compiler, n: *nfa): *dfa {
+	var live: nlist;
+	var key: nlist;
+	var start: *dfa;
+	var d: *dfa;
+	var m: *nfa;
+	var i: int;
+	var j: int;
+	var k: int;
+	var e: int;
+
+	byte_classes(c);
+
+	c.first = alloc(&c.a, sizeof(*c.first) * c.nclass):*int;
+
+	alloc_nlist(c, &live, c.nnfa);
+	alloc_nlist(c, &key, c.nnfa);
+
+	activate(&live, n);
+	nlist_kernel(&key, &live);
+	start = nlist2dfa(c, &key);
+
+	i = 0;
+	loop {
+		if (i == c.ndfa) {
 			break;
 		}
 
-		deactivate(l);
+		d = c.states[i];
+
+		// Sort the nodes of the state by the classes they accept
+		k = 0;
+		loop {
+			if (k == c.nclass) {
+				break;
+			}
+			c.first[k] = -1;
+			k = k + 1;
+		}
+
+		c.nedge = 0;
 		j = 0;
 		loop {
 			if (j >= d.key.fill) {
 				break;
 			}
 
-			n = d.key.live[j];
-			if (n.left <= i && i < n.right) {
-				if (n.a) {
-					activate(l, n.a);
-				}
-				if (n.b) {
-					activate(l, n.b);
+			m = d.key.live[j];
+			if (m.left < m.right) {
+				k = c.classes[m.left];
+			} else {
+				k = c.nclass;
+			}
+			loop {
+				if (k == c.nclass || c.rep[k] >= m.right) {
+					break;
 				}
+				add_edge(c, k, m);
+				k = k + 1;
 			}
 
 			j = j + 1;
 		}
 
-		d.link[i] = nlist2dfa(c, l);
+		k = 0;
+		loop {
+			if (k == c.nclass) {
+				break;
+			}
+
+			if (c.first[k] != -1) {
+				deactivate(&live);
+
+				e = c.first[k];
+				loop {
+					if (e == -1) {
+						break;
+					}
+
+					m = c.enode[e];
+					if (m.a) {
+						activate(&live, m.a);
+					}
+					if (m.b) {
+						activate(&live, m.b);
+					}
+
+					e = c.enext[e];
+				}
+
+				nlist_kernel(&key, &live);
+				d.link[k] = nlist2dfa(c, &key);
+			}
+
+			k = k + 1;
+		}
 
 		i = i + 1;
 	}
 
-	return d;
+	deactivate(&live);
+
+	return start;
 }
 
-deactivate(l: *nlist): void {
+// Partition refinement state for minimize. States are kept in elem grouped
+// by block, with the marked states of a block moved to its front.
+struct hopcroft {
+	n: int;
+	nclass: int;
+	elem: *int;
+	loc: *int;
+	block: *int;
+	first: *int;
+	end: *int;
+	mid: *int;
+	nblock: int;
+	touched: *int;
+	ntouched: int;
+	work: *int;
+	nwork: int;
+	inwork: *int;
+	invhead: *int;
+	invnext: *int;
+	splitter: *int;
+}
+
+alloc_ints(a: *alloc, n: int, x: int): *int {
+	var p: *int;
 	var i: int;
+	p = alloc(a, sizeof(*p) * n):*int;
 	i = 0;
 	loop {
-		if (i >= l.fill) {
-			l.fill = 0;
-			l.tag = 0: *tag;
+		if (i == n) {
 			break;
 		}
-		l.live[i].live = 0;
+		p[i] = x;
 		i = i + 1;
 	}
+	return p;
 }
 
-powerset(c: *compiler, n: *nfa): *dfa {
-	var live: nlist;
-	alloc_nlist(c, &live, c.nnfa);
-	activate(&live, n);
-	return nlist2dfa(c, &live);
+hop_push(h: *hopcroft, b: int, k: int): void {
+	if (h.inwork[b * h.nclass + k]) {
+		return;
+	}
+	h.inwork[b * h.nclass + k] = 1;
+	h.work[h.nwork] = b * h.nclass + k;
+	h.nwork = h.nwork + 1;
 }
 
-codegen(c: *compiler, a: *dfa): void {
+hop_mark(h: *hopcroft, s: int): void {
+	var b: int;
 	var i: int;
-	var b: *dfa;
-	var lo: int;
-	var hi: int;
+	var t: int;
+
+	b = h.block[s];
+	i = h.loc[s];
+	if (i < h.mid[b]) {
+		return;
+	}
+
+	if (h.mid[b] == h.first[b]) {
+		h.touched[h.ntouched] = b;
+		h.ntouched = h.ntouched + 1;
+	}
+
+	t = h.elem[h.mid[b]];
+	h.elem[i] = t;
+	h.loc[t] = i;
+	h.elem[h.mid[b]] = s;
+	h.loc[s] = h.mid[b];
+	h.mid[b] = h.mid[b] + 1;
+}
+
+// Move the marked states of each touched block into a block of their own
+hop_split(h: *hopcroft): void {
+	var b: int;
+	var z: int;
+	var i: int;
+	var k: int;
+
+	loop {
+		if (h.ntouched == 0) {
+			break;
+		}
+		h.ntouched = h.ntouched - 1;
+		b = h.touched[h.ntouched];
+
+		if (h.mid[b] == h.end[b]) {
+			h.mid[b] = h.first[b];
+			continue;
+		}
+
+		z = h.nblock;
+		h.nblock = h.nblock + 1;
+		h.first[z] = h.first[b];
+		h.end[z] = h.mid[b];
+		h.mid[z] = h.first[z];
+		h.first[b] = h.mid[b];
+
+		i = h.first[z];
+		loop {
+			if (i == h.end[z]) {
+				break;
+			}
+			h.block[h.elem[i]] = z;
+			i = i + 1;
+		}
+
+		// Either half is enough as a splitter unless b was already
+		// waiting, in which case both halves are.
+		k = 0;
+		loop {
+			if (k == h.nclass) {
+				break;
+			}
+			if (h.inwork[b * h.nclass + k]) {
+				hop_push(h, z, k);
+			} else if (h.end[z] - h.first[z] < h.end[b] - h.first[b]) {
+				hop_push(h, z, k);
+			} else {
+				hop_push(h, b, k);
+			}
+			k = k + 1;
+		}
+	}
+}
+
+// Merge equivalent states with Hopcroft's algorithm. States start out
+// split by the tag they accept, so a merged state still reports the
+// highest priority tag. Missing links go to an extra dead state.
+minimize(c: *compiler, a: *dfa): *dfa {
+	var h: hopcroft;
+	var d: *dfa;
+	var t: *dfa;
+	var dead: int;
+	var rep: **dfa;
+	var link: **dfa;
+	var s: int;
+	var b: int;
+	var i: int;
+	var k: int;
+	var e: int;
+	var w: int;
+	var id: int;
+
+	if (!a) {
+		return a;
+	}
+
+	dead = c.ndfa;
+	h.n = c.ndfa + 1;
+	h.nclass = c.nclass;
+
+	// Predecessors of each state by class
+	h.invhead = alloc_ints(&c.tmp.a, h.n * h.nclass, -1);
+	h.invnext = alloc_ints(&c.tmp.a, h.n * h.nclass, -1);
+	s = 0;
+	loop {
+		if (s == h.n) {
+			break;
+		}
+		k = 0;
+		loop {
+			if (k == h.nclass) {
+				break;
+			}
+			if (s == dead || !c.states[s].link[k]) {
+				e = dead * h.nclass + k;
+			} else {
+				e = c.states[s].link[k].id * h.nclass + k;
+			}
+			h.invnext[s * h.nclass + k] = h.invhead[e];
+			h.invhead[e] = s * h.nclass + k;
+			k = k + 1;
+		}
+		s = s + 1;
+	}
+
+	// Initial blocks by tag, with the dead state in the block for no tag
+	h.elem = alloc_ints(&c.tmp.a, h.n, 0);
+	h.loc = alloc_ints(&c.tmp.a, h.n, 0);
+	h.block = alloc_ints(&c.tmp.a, h.n, 0);
+	h.first = alloc_ints(&c.tmp.a, h.n, 0);
+	h.end = alloc_ints(&c.tmp.a, h.n, 0);
+	h.mid = alloc_ints(&c.tmp.a, h.n, 0);
+	h.touched = alloc_ints(&c.tmp.a, h.n, 0);
+	h.splitter = alloc_ints(&c.tmp.a, h.n, 0);
+	h.inwork = alloc_ints(&c.tmp.a, h.n * h.nclass, 0);
+	h.work = alloc_ints(&c.tmp.a, h.n * h.nclass, 0);
+	h.ntouched = 0;
+	h.nwork = 0;
+
+	h.nblock = 0;
+	i = 0;
+	b = -1;
+	loop {
+		if (b == c.ntags) {
+			break;
+		}
+
+		h.first[h.nblock] = i;
+		s = 0;
+		loop {
+			if (s == h.n) {
+				break;
+			}
+			if (s == dead || !c.states[s].key.tag) {
+				id = -1;
+			} else {
+				id = c.states[s].key.tag.id;
+			}
+			if (id == b) {
+				h.elem[i] = s;
+				h.loc[s] = i;
+				h.block[s] = h.nblock;
+				i = i + 1;
+			}
+			s = s + 1;
+		}
+		h.end[h.nblock] = i;
+		h.mid[h.nblock] = h.first[h.nblock];
+
+		if (h.end[h.nblock] != h.first[h.nblock]) {
+			k = 0;
+			loop {
+				if (k == h.nclass) {
+					break;
+				}
+				hop_push(&h, h.nblock, k);
+				k = k + 1;
+			}
+			h.nblock = h.nblock + 1;
+		}
+
+		b = b + 1;
+	}
+
+	// Split blocks by whether their states step into the splitter
+	loop {
+		if (h.nwork == 0) {
+			break;
+		}
+		h.nwork = h.nwork - 1;
+		w = h.work[h.nwork];
+		h.inwork[w] = 0;
+		b = w / h.nclass;
+		k = w % h.nclass;
+
+		// Copy the splitter since marking reorders its states
+		i = 0;
+		loop {
+			if (h.first[b] + i == h.end[b]) {
+				break;
+			}
+			h.splitter[i] = h.elem[h.first[b] + i];
+			i = i + 1;
+		}
+
+		w = i;
+		i = 0;
+		loop {
+			if (i == w) {
+				break;
+			}
+			e = h.invhead[h.splitter[i] * h.nclass + k];
+			loop {
+				if (e == -1) {
+					break;
+				}
+				hop_mark(&h, e / h.nclass);
+				e = h.invnext[e];
+			}
+			i = i + 1;
+		}
+
+		hop_split(&h);
+	}
+
+	// The first state of each block stands for the rest, numbered in the
+	// order the original states were found so the start state stays first.
+	rep = alloc(&c.tmp.a, sizeof(*rep) * h.nblock):**dfa;
+	b = 0;
+	loop {
+		if (b == h.nblock) {
+			break;
+		}
+		rep[b] = 0:*dfa;
+		b = b + 1;
+	}
+
+	s = 0;
+	loop {
+		if (s == c.ndfa) {
+			break;
+		}
+		b = h.block[s];
+		if (b != h.block[dead] && !rep[b]) {
+			rep[b] = c.states[s];
+		}
+		s = s + 1;
+	}
+
+	b = 0;
+	loop {
+		if (b == h.nblock) {
+			break;
+		}
+		d = rep[b];
+		if (d) {
+			link = alloc_link(c);
+			k = 0;
+			loop {
+				if (k == c.nclass) {
+					break;
+				}
+				t = d.link[k];
+				if (t) {
+					link[k] = rep[h.block[t.id]];
+				}
+				k = k + 1;
+			}
+			d.link = link;
+		}
+		b = b + 1;
+	}
+
+	id = 0;
+	s = 0;
+	loop {
+		if (s == c.ndfa) {
+			break;
+		}
+		d = c.states[s];
+		if (rep[h.block[s]] == d) {
+			c.states[id] = d;
+			id = id + 1;
+		}
+		s = s + 1;
+	}
+
+	s = 0;
+	loop {
+		if (s == id) {
+			break;
+		}
+		c.states[s].id = s;
+		s = s + 1;
+	}
+
+	c.ndfa = id;
+
+	scratch_reset(&c.tmp);
+
+	return c.states[0];
+}
+
+outtabs(c: *compiler, n: int): void {
+	loop {
+		if (n == 0) {
+			break;
+		}
+		fputc(c.out, '\t');
+		n = n - 1;
+	}
+}
 
-	if (a.seen) {
+// Emit the tests for the byte ranges r[i..j), each three ints: first byte,
+// last byte and target state. Long lists are bisected so that a byte costs
+// a logarithmic number of compares instead of one per range.
+genranges(c: *compiler, r: *int, i: int, j: int, depth: int): void {
+	var m: int;
+
+	if (j - i > 3) {
+		m = (i + j) >> 1;
+
+		outtabs(c, depth);
+		fputs(c.out, "if (ch < ");
+		fputd(c.out, r[3 * m]);
+		fputs(c.out, ") {\n");
+		genranges(c, r, i, m, depth + 1);
+		outtabs(c, depth);
+		fputs(c.out, "} else {\n");
+		genranges(c, r, m, j, depth + 1);
+		outtabs(c, depth);
+		fputs(c.out, "}\n");
 		return;
 	}
-	a.seen = 1;
 
-	fdputs(1, ":_");
-	fdputd(1, a.id);
-	fdputs(1, ";\n");
+	loop {
+		if (i == j) {
+			break;
+		}
+
+		outtabs(c, depth);
+		if (r[3 * i] != r[3 * i + 1]) {
+			fputs(c.out, "if (ch >= ");
+			fputd(c.out, r[3 * i]);
+			fputs(c.out, " && ch <= ");
+			fputd(c.out, r[3 * i + 1]);
+		} else {
+			fputs(c.out, "if (ch == ");
+			fputd(c.out, r[3 * i]);
+		}
+		fputs(c.out, ") { ");
+		fputs(c.out, "goto _");
+		fputd(c.out, r[3 * i + 2]);
+		fputs(c.out, "; }\n");
+
+		i = i + 1;
+	}
+}
+
+// Emit a state. r has room for the 256 ranges a state can have.
+codegen(c: *compiler, a: *dfa, r: *int): void {
+	var i: int;
+	var n: int;
+	var b: *dfa;
+	var lo: int;
+	var hi: int;
+
+	fputs(c.out, ":_");
+	fputd(c.out, a.id);
+	fputs(c.out, ";\n");
 
 	if (a.key.tag) {
-		fdputs(1, "\tlexmark(l, T_");
-		fdputs(1, a.key.tag.s);
-		fdputs(1, ");\n");
+		fputs(c.out, "\tlexmark(l, T_");
+		fputs(c.out, a.key.tag.s);
+		fputs(c.out, ");\n");
 	}
 
-	fdputs(1, "\tch = lexfeedc(l);\n");
+	fputs(c.out, "\tch = lexfeedc(l);\n");
 
+	n = 0;
 	i = 0;
 	loop {
 		loop {
-			if (i == 256 || a.link[i]) {
+			if (i == 256 || a.link[c.classes[i]]) {
 				lo = i;
 				break;
 			}
@@ -1038,78 +1686,274 @@ codegen(c: *compiler, a: *dfa): void {
 			break;
 		}
 
-		b = a.link[i];
+		b = a.link[c.classes[i]];
 
 		loop {
-			if (i == 256 || a.link[i] != b) {
+			if (i == 256 || a.link[c.classes[i]] != b) {
 				hi = i;
 				break;
 			}
 			i = i + 1;
 		}
 
-		if (lo != (hi - 1)) {
-			fdputs(1, "\tif (ch >= ");
-			fdputd(1, lo);
-			fdputs(1, " && ch <= ");
-			fdputd(1, hi - 1);
+		r[3 * n] = lo;
+		r[3 * n + 1] = hi - 1;
+		r[3 * n + 2] = b.id;
+		n = n + 1;
+	}
+
+	genranges(c, r, 0, n, 1);
+
+	fputs(c.out, "\treturn;\n");
+}
+
+// Write the values v[0..n-1] as a string literal, adding one to each so
+// that none of them is a terminating zero.
+outbytes(c: *compiler, v: *int, n: int): void {
+	var i: int;
+	var x: int;
+
+	fputc(c.out, '"');
+	i = 0;
+	loop {
+		if (i == n) {
+			break;
+		}
+
+		x = v[i] + 1;
+		if (x < 1 || x > 255) {
+			die("table value out of range");
+		}
+
+		if (x >= 32 && x < 127 && x != '"' && x != '\\') {
+			fputc(c.out, x);
 		} else {
-			fdputs(1, "\tif (ch == ");
-			fdputd(1, lo);
+			fputs(c.out, "\\x");
+			fputc(c.out, "0123456789abcdef"[x >> 4]:int);
+			fputc(c.out, "0123456789abcdef"[x & 15]:int);
 		}
-		fdputs(1, ") { ");
-		fdputs(1, "goto _");
-		fdputd(1, b.id);
-		fdputs(1, "; }\n");
 
+		i = i + 1;
 	}
+	fputc(c.out, '"');
+}
 
-	fdputs(1, "\treturn;\n");
+// Emit lexstep as a loop over a comb-packed transition table. Row s of the
+// table starts at base[s] and column k belongs to it when check[base[s] + k]
+// is s.
+gentable(c: *compiler): void {
+	var next: *int;
+	var check: *int;
+	var base: *int;
+	var lo: *int;
+	var hi: *int;
+	var acc: *int;
+	var d: *dfa;
+	var s: int;
+	var b: int;
+	var k: int;
+	var len: int;
 
-	i = 0;
+	if (c.ndfa > 254 || c.nclass > 254) {
+		die("too many states for -t");
+	}
+
+	len = c.ndfa * c.nclass + c.nclass;
+	next = alloc_ints(&c.tmp.a, len, 0);
+	check = alloc_ints(&c.tmp.a, len, 254);
+	base = alloc_ints(&c.tmp.a, c.ndfa + 1, 0);
+	acc = alloc_ints(&c.tmp.a, c.ndfa + 1, 0);
+
+	len = c.nclass;
+	s = 0;
 	loop {
-		if (i == 256) {
+		if (s == c.ndfa) {
 			break;
 		}
 
-		if (a.link[i]) {
-			codegen(c, a.link[i]);
+		d = c.states[s];
+
+		// Find the first offset where the row's entries land on free slots
+		b = 0;
+		loop {
+			k = 0;
+			loop {
+				if (k == c.nclass) {
+					break;
+				}
+				if (d.link[k] && check[b + k] != 254) {
+					break;
+				}
+				k = k + 1;
+			}
+
+			if (k == c.nclass) {
+				break;
+			}
+
+			b = b + 1;
 		}
 
-		i = i + 1;
+		base[s] = b;
+		k = 0;
+		loop {
+			if (k == c.nclass) {
+				break;
+			}
+			if (d.link[k]) {
+				check[b + k] = s;
+				next[b + k] = d.link[k].id;
+			}
+			k = k + 1;
+		}
+
+		if (b + c.nclass > len) {
+			len = b + c.nclass;
+		}
+
+		if (d.key.tag) {
+			acc[s] = d.key.tag.id + 2;
+		}
+
+		s = s + 1;
+	}
+
+	if (len > 254 * 255) {
+		die("too many states for -t");
+	}
+
+	lo = alloc_ints(&c.tmp.a, c.ndfa + 1, 0);
+	hi = alloc_ints(&c.tmp.a, c.ndfa + 1, 0);
+	s = 0;
+	loop {
+		if (s == c.ndfa) {
+			break;
+		}
+		lo[s] = base[s] % 255;
+		hi[s] = base[s] / 255;
+		s = s + 1;
 	}
+
+	fputs(c.out, "\tvar ch: int;\n");
+	fputs(c.out, "\tvar s: int;\n");
+	fputs(c.out, "\tvar t: int;\n");
+	fputs(c.out, "\tvar i: int;\n");
+	fputs(c.out, "\tlexmark(l, T_INVALID);\n");
+
+	if (c.ndfa == 0) {
+		return;
+	}
+
+	fputs(c.out, "\ts = 0;\n");
+	fputs(c.out, "\tloop {\n");
+	fputs(c.out, "\t\tt = ");
+	outbytes(c, acc, c.ndfa);
+	fputs(c.out, "[s]:int - 1;\n");
+	fputs(c.out, "\t\tif (t) {\n");
+	fputs(c.out, "\t\t\tlexmark(l, t);\n");
+	fputs(c.out, "\t\t}\n");
+	fputs(c.out, "\t\tch = lexfeedc(l);\n");
+	fputs(c.out, "\t\tif (ch < 0) {\n");
+	fputs(c.out, "\t\t\treturn;\n");
+	fputs(c.out, "\t\t}\n");
+	fputs(c.out, "\t\ti = ");
+	outbytes(c, lo, c.ndfa);
+	fputs(c.out, "[s]:int + ");
+	outbytes(c, hi, c.ndfa);
+	fputs(c.out, "[s]:int * 255 - 256 + ");
+	outbytes(c, c.classes, 256);
+	fputs(c.out, "[ch]:int - 1;\n");
+	fputs(c.out, "\t\tif (");
+	outbytes(c, check, len);
+	fputs(c.out, "[i]:int - 1 != s) {\n");
+	fputs(c.out, "\t\t\treturn;\n");
+	fputs(c.out, "\t\t}\n");
+	fputs(c.out, "\t\ts = ");
+	outbytes(c, next, len);
+	fputs(c.out, "[i]:int - 1;\n");
+	fputs(c.out, "\t}\n");
 }
 
-gen(c: *compiler, a: *dfa): void {
+gen(c: *compiler, a: *dfa, table: int): void {
 	var t: *tag;
+	var r: *int;
+	var i: int;
 	t = c.tags;
-	fdputs(1, "enum {\n");
-	fdputs(1, "\tT_INVALID,\n");
-	fdputs(1, "\tT_EOF,\n");
+	fputs(c.out, "enum {\n");
+	fputs(c.out, "\tT_INVALID,\n");
+	fputs(c.out, "\tT_EOF,\n");
 	loop {
 		if (!t) {
 			break;
 		}
-		fdputs(1, "\tT_");
-		fdputs(1, t.s);
-		fdputs(1, ",\n");
+		fputs(c.out, "\tT_");
+		fputs(c.out, t.s);
+		fputs(c.out, ",\n");
 		t = t.next;
 	}
-	fdputs(1, "}\n");
-	fdputs(1, "\n");
-	fdputs(1, "lexstep(l: *lex_state): void {\n");
-	fdputs(1, "\tvar ch: int;\n");
-	fdputs(1, "\tlexmark(l, T_INVALID);\n");
-	codegen(c, a);
-	fdputs(1, "}\n");
+	fputs(c.out, "}\n");
+	fputs(c.out, "\n");
+	fputs(c.out, "lexstep(l: *lex_state): void {\n");
+	if (table) {
+		gentable(c);
+	} else {
+		fputs(c.out, "\tvar ch: int;\n");
+		fputs(c.out, "\tlexmark(l, T_INVALID);\n");
+		r = alloc_ints(&c.tmp.a, 3 * 256, 0);
+		i = 0;
+		loop {
+			if (i == c.ndfa) {
+				break;
+			}
+			codegen(c, c.states[i], r);
+			i = i + 1;
+		}
+	}
+	scratch_reset(&c.tmp);
+	fputs(c.out, "}\n");
+	fflush(c.out);
 }
 
 main(argc: int, argv: **byte, envp: **byte): void {
 	var c: compiler;
 	var n: *nfa;
 	var a: *dfa;
+	var verbose: int;
+	var table: int;
+	var before: int;
+	var i: int;
+
+	verbose = 0;
+	table = 0;
+	i = 1;
+	loop {
+		if (i >= argc) {
+			break;
+		}
+		if (!strcmp(argv[i], "-v")) {
+			verbose = 1;
+		} else if (!strcmp(argv[i], "-t")) {
+			table = 1;
+		} else {
+			die("usage: genlex [-t] [-v] < input.l > output.c");
+		}
+		i = i + 1;
+	}
+
 	setup(&c);
 	n = parse_program(&c);
 	a = powerset(&c, n);
-	gen(&c, a);
+
+	before = c.ndfa;
+	a = minimize(&c, a);
+
+	if (verbose) {
+		fdputs(2, "genlex: ");
+		fdputd(2, before);
+		fdputs(2, " states, ");
+		fdputd(2, c.ndfa);
+		fdputs(2, " after minimization\n");
+	}
+
+	gen(&c, a, table);
 }
@@ -118,15 +118,7 @@ idt_gate(s: *int, offset: int, dpl: int, ist: int) {
 }
 
 bzero(s: *byte, size: int) {
-	var i: int;
-	i = 0;
-	loop {
-		if i == size {
-			break;
-		}
-		s[i] = 0:byte;
-		i = i + 1;
-	}
+	memset(s, 0, size);
 }
 
 panic(r: *regs) {
@@ -229,6 +221,13 @@ _isr(r: *regs) {
 	var global: *global;
 	global = g();
 
+	if r.trap == 14 && rdcr2() >= 0 && rdcr2() < (1 << 47) {
+		// Page fault in the user half
+		if vfault(rdcr2(), r.err) == 0 {
+			return;
+		}
+	}
+
 	if (r.trap < 32) {
 		kputs("EX ");
 		kputd(r.trap);
@@ -275,6 +274,19 @@ memcmp(a: *byte, b: *byte, n: int): int {
 
 	i = 0;
 
+	// Skip equal words, then find the first differing byte
+	loop {
+		if (n - i < 8) {
+			break;
+		}
+
+		if (*((&a[i]):*int) != *((&b[i]):*int)) {
+			break;
+		}
+
+		i = i + 8;
+	}
+
 	loop {
 		if i == n {
 			return 0;
@@ -495,7 +507,7 @@ map_pci(pa: int): *byte {
 	pt4 = ptov(pt4p):*int;
 	v2 = ((va: int) >> 30) & 511;
 	pt3 = ptov(pt4[511] & -4096):*int;
-	flags = 0x93;
+	flags = 0x93 | PTE_G;
 	pt3[v2] = (pa & -(1 << 30)) | flags;
 	pt3[v2 + 1] = ((pa + (1 << 30)) & -(1 << 30)) | flags;
 	invlpt();
@@ -797,6 +809,10 @@ struct tcp_state {
 	fin_seq: int;
 
 	task: *task;
+
+	// Counts the segments handled, for tasks waiting on the connection
+	nevent: int;
+	wait: waitq;
 }
 
 struct task {
@@ -811,6 +827,46 @@ struct task {
 	a: *void;
 	regs: regs;
 	pt: int;
+	pcid: int;
+	vma: *vma;
+	pid: int;
+	ppid: int;
+	status: int;
+	reaped: int;
+	sleeping: int;
+	wnext: *task;
+	deadline: int;
+}
+
+// A task waits for an event by going on a queue and sleeping until wake_up
+// empties the queue. Check the condition it waits for and call sleep_on
+// with interrupts disabled, so that a wake_up from an interrupt cannot
+// slip in between:
+//
+//	flags = rdflags();
+//	cli();
+//	loop {
+//		if condition {
+//			break;
+//		}
+//		sleep_on(&q);
+//	}
+//	wrflags(flags);
+struct waitq {
+	head: *task;
+}
+
+// A range of a user address space that is filled in by vfault when first
+// touched. The first filesz bytes come from node starting at offset, and
+// the rest read as zero. start, offset and end are page aligned.
+struct vma {
+	next: *vma;
+	start: int;
+	end: int;
+	flags: int;
+	node: *vnode;
+	offset: int;
+	filesz: int;
 }
 
 struct global {
@@ -818,7 +874,7 @@ struct global {
 	ms: int;
 	vga: vga;
 	fr: *free_range;
-	fp: *free_page;
+	buddy: *buddy;
 	kpt: int;
 	lapicp: int;
 	lapic: *byte;
@@ -838,13 +894,50 @@ struct global {
 	_save: int;
 	root: *vfile;
 	next_ino: int;
+	next_pid: int;
+	next_pcid: int;
+	pcid_task: **task;
+	idle: *task;
+	timers: waitq;
+	exits: waitq;
+	kcache: *kcache;
+}
+
+// Physical pages are managed by a buddy allocator. A block of order k is
+// 4096 << k bytes, aligned to its size, and its buddy is the other half of
+// the block of order k + 1 containing it. Free blocks of each order are on
+// a list threaded through the blocks themselves. Each zone keeps a byte per
+// page, which is k + 1 when a free block of order k starts there, so free
+// can tell whether the buddy is free and merge the two.
+//
+// Zones also count, for each page, the page tables that map it beyond the
+// first. After fork both processes map their private pages read-only until
+// one of them writes, and a page is freed when the last table lets go.
+enum {
+	BUDDY_NORDER = 11,
 }
 
-struct free_page {
-	next: *free_page;
+struct buddy_block {
+	next: *buddy_block;
+	prev: *buddy_block;
 	pa: int;
 }
 
+struct buddy_zone {
+	next: *buddy_zone;
+	start: int;
+	end: int;
+	order: *byte;
+	ref: *int;
+}
+
+struct buddy {
+	zones: *buddy_zone;
+	free: **buddy_block;
+	nfree: *int;
+	nalloc: *int;
+}
+
 struct free_range {
 	next: *free_range;
 	start: int;
@@ -861,12 +954,34 @@ rand(): int {
 
 memset(dest: *byte, c: int, size: int) {
 	var i: int;
+	var x: int;
 
 	if size < 0 {
 		return;
 	}
 
 	i = 0;
+	if size >= 16 {
+		loop {
+			if ((dest:int + i) & 7) == 0 {
+				break;
+			}
+			dest[i] = c:byte;
+			i = i + 1;
+		}
+
+		x = 0x01010101;
+		x = (x | (x << 32)) * (c & 255);
+
+		loop {
+			if size - i < 8 {
+				break;
+			}
+			*((&dest[i]):*int) = x;
+			i = i + 8;
+		}
+	}
+
 	loop {
 		if i == size {
 			break;
@@ -877,7 +992,18 @@ memset(dest: *byte, c: int, size: int) {
 }
 
 memcpy(dest: *byte, src: *byte, size: int) {
+	memmove(dest, src, size);
+}
+
+// Copy size bytes, which may overlap. Words are moved in the direction
+// that reads each source byte before it is overwritten, with the stores
+// aligned.
+memmove(dest: *byte, src: *byte, size: int) {
 	var i: int;
+	var w0: int;
+	var w1: int;
+	var w2: int;
+	var w3: int;
 
 	if size < 0 {
 		return;
@@ -885,6 +1011,40 @@ memcpy(dest: *byte, src: *byte, size: int) {
 
 	if src > dest {
 		i = 0;
+
+		if size >= 16 {
+			loop {
+				if ((dest:int + i) & 7) == 0 {
+					break;
+				}
+				dest[i] = src[i];
+				i = i + 1;
+			}
+
+			loop {
+				if size - i < 32 {
+					break;
+				}
+				w0 = *((&src[i]):*int);
+				w1 = *((&src[i + 8]):*int);
+				w2 = *((&src[i + 16]):*int);
+				w3 = *((&src[i + 24]):*int);
+				*((&dest[i]):*int) = w0;
+				*((&dest[i + 8]):*int) = w1;
+				*((&dest[i + 16]):*int) = w2;
+				*((&dest[i + 24]):*int) = w3;
+				i = i + 32;
+			}
+
+			loop {
+				if size - i < 8 {
+					break;
+				}
+				*((&dest[i]):*int) = *((&src[i]):*int);
+				i = i + 8;
+			}
+		}
+
 		loop {
 			if i == size {
 				break;
@@ -894,6 +1054,40 @@ memcpy(dest: *byte, src: *byte, size: int) {
 		}
 	} else if src < dest {
 		i = size;
+
+		if size >= 16 {
+			loop {
+				if ((dest:int + i) & 7) == 0 {
+					break;
+				}
+				i = i - 1;
+				dest[i] = src[i];
+			}
+
+			loop {
+				if i < 32 {
+					break;
+				}
+				w0 = *((&src[i - 8]):*int);
+				w1 = *((&src[i - 16]):*int);
+				w2 = *((&src[i - 24]):*int);
+				w3 = *((&src[i - 32]):*int);
+				*((&dest[i - 8]):*int) = w0;
+				*((&dest[i - 16]):*int) = w1;
+				*((&dest[i - 24]):*int) = w2;
+				*((&dest[i - 32]):*int) = w3;
+				i = i - 32;
+			}
+
+			loop {
+				if i < 8 {
+					break;
+				}
+				i = i - 8;
+				*((&dest[i]):*int) = *((&src[i]):*int);
+			}
+		}
+
 		loop {
 			if i == 0 {
 				break;
@@ -977,65 +1171,310 @@ mmap_cmp(a: *void, b: *void): int {
 	return 0;
 }
 
-free(p: *byte) {
+buddy_zone(pa: int): *buddy_zone {
 	var global: *global;
-	var fp: *free_page;
-	var flags: int;
+	var z: *buddy_zone;
 
 	global = g();
 
-	if !p {
-		return;
+	z = global.buddy.zones;
+	loop {
+		if !z {
+			kdie("BAD PAGE");
+		}
+
+		if pa >= z.start && pa < z.end {
+			return z;
+		}
+
+		z = z.next;
+	}
+}
+
+buddy_push(b: *buddy, z: *buddy_zone, pa: int, order: int) {
+	var p: *buddy_block;
+
+	p = ptov(pa):*buddy_block;
+	p.pa = pa;
+	p.prev = 0:*buddy_block;
+	p.next = b.free[order];
+	if p.next {
+		p.next.prev = p;
 	}
+	b.free[order] = p;
+	b.nfree[order] = b.nfree[order] + 1;
 
-	if p:int & 4095 != 0 {
-		kdie("BAD FREE");
+	z.order[(pa - z.start) >> 12] = (order + 1):byte;
+}
+
+buddy_unlink(b: *buddy, z: *buddy_zone, p: *buddy_block, order: int) {
+	if p.prev {
+		p.prev.next = p.next;
+	} else {
+		b.free[order] = p.next;
+	}
+	if p.next {
+		p.next.prev = p.prev;
+	}
+	b.nfree[order] = b.nfree[order] - 1;
+
+	z.order[(p.pa - z.start) >> 12] = 0:byte;
+}
+
+// Allocate 4096 << order physically contiguous bytes, aligned to their size
+alloc_pages(order: int): int {
+	var global: *global;
+	var b: *buddy;
+	var z: *buddy_zone;
+	var p: *buddy_block;
+	var flags: int;
+	var k: int;
+	var pa: int;
+
+	if order < 0 || order >= BUDDY_NORDER {
+		kdie("BAD ORDER");
 	}
 
-	fp = p:*free_page;
-	fp.pa = vtop(p);
+	global = g();
+	b = global.buddy;
 
 	flags = rdflags();
 	cli();
-	fp.next = global.fp;
-	global.fp = fp;
+
+	k = order;
+	loop {
+		if k == BUDDY_NORDER {
+			kdie("OOM");
+		}
+
+		if b.free[k] {
+			break;
+		}
+
+		k = k + 1;
+	}
+
+	p = b.free[k];
+	pa = p.pa;
+	z = buddy_zone(pa);
+	buddy_unlink(b, z, p, k);
+
+	// Return the upper halves until the block is the right size
+	loop {
+		if k == order {
+			break;
+		}
+
+		k = k - 1;
+		buddy_push(b, z, pa + (4096 << k), k);
+	}
+
+	b.nalloc[order] = b.nalloc[order] + 1;
+
 	wrflags(flags);
+
+	return pa;
 }
 
-alloc_page(): int {
+free_pages(pa: int, order: int) {
 	var global: *global;
-	var fr: *free_range;
-	var fp: *free_page;
+	var b: *buddy;
+	var z: *buddy_zone;
 	var flags: int;
-	var ret: int;
+	var buddy: int;
+
+	if pa & ((4096 << order) - 1) != 0 {
+		kdie("BAD FREE");
+	}
+
 	global = g();
+	b = global.buddy;
+	z = buddy_zone(pa);
 
 	flags = rdflags();
 	cli();
 
-	fp = global.fp;
-	if fp {
-		global.fp = fp.next;
-		wrflags(flags);
-		return fp.pa;
+	b.nalloc[order] = b.nalloc[order] - 1;
+
+	loop {
+		if order + 1 == BUDDY_NORDER {
+			break;
+		}
+
+		buddy = pa ^ (4096 << order);
+		if buddy < z.start || buddy + (4096 << order) > z.end {
+			break;
+		}
+
+		if z.order[(buddy - z.start) >> 12]:int != order + 1 {
+			break;
+		}
+
+		buddy_unlink(b, z, ptov(buddy):*buddy_block, order);
+
+		pa = pa & ~(4096 << order);
+		order = order + 1;
+	}
+
+	buddy_push(b, z, pa, order);
+
+	wrflags(flags);
+}
+
+// Turn the usable memory ranges into zones. The first pages of each zone
+// hold its order bytes and reference counts, and the rest is cut into the largest aligned
+// blocks that fit.
+setup_buddy(brk: *int) {
+	var global: *global;
+	var b: *buddy;
+	var z: *buddy_zone;
+	var fr: *free_range;
+	var npages: int;
+	var meta: int;
+	var pa: int;
+	var k: int;
+
+	global = g();
+
+	b = brk[0]:*buddy;
+	brk[0] = brk[0] + sizeof(*b);
+	b.zones = 0:*buddy_zone;
+	b.free = brk[0]:**buddy_block;
+	brk[0] = brk[0] + BUDDY_NORDER * sizeof(*b.free);
+	b.nfree = brk[0]:*int;
+	brk[0] = brk[0] + BUDDY_NORDER * sizeof(*b.nfree);
+	b.nalloc = brk[0]:*int;
+	brk[0] = brk[0] + BUDDY_NORDER * sizeof(*b.nalloc);
+
+	k = 0;
+	loop {
+		if k == BUDDY_NORDER {
+			break;
+		}
+		b.free[k] = 0:*buddy_block;
+		b.nfree[k] = 0;
+		b.nalloc[k] = 0;
+		k = k + 1;
 	}
+
+	global.buddy = b;
+
 	fr = global.fr;
 	loop {
 		if !fr {
 			break;
 		}
 
-		if fr.start < fr.end {
-			ret = fr.start;
-			fr.start = fr.start + 4096;
-			wrflags(flags);
-			return ret;
+		npages = (fr.end - fr.start) >> 12;
+		meta = (((npages + 7) & -8) + npages * sizeof(*z.ref) + 4095) >> 12;
+
+		if npages > meta {
+			z = brk[0]:*buddy_zone;
+			brk[0] = brk[0] + sizeof(*z);
+
+			z.order = ptov(fr.start);
+			z.ref = (&z.order[(npages + 7) & -8]):*int;
+			z.start = fr.start + (meta << 12);
+			z.end = fr.end;
+			bzero(z.order, npages - meta);
+			bzero(z.ref:*byte, (npages - meta) * sizeof(*z.ref));
+
+			z.next = b.zones;
+			b.zones = z;
+
+			pa = z.start;
+			loop {
+				if pa == z.end {
+					break;
+				}
+
+				k = BUDDY_NORDER - 1;
+				loop {
+					if pa & ((4096 << k) - 1) == 0 && pa + (4096 << k) <= z.end {
+						break;
+					}
+					k = k - 1;
+				}
+
+				buddy_push(b, z, pa, k);
+				pa = pa + (4096 << k);
+			}
 		}
 
 		fr = fr.next;
 	}
+}
+
+// Print the free blocks and outstanding allocations of each order. Not
+// called on the normal path; call it when debugging the allocator.
+pagestat() {
+	var global: *global;
+	var b: *buddy;
+	var k: int;
+
+	global = g();
+	b = global.buddy;
+
+	k = 0;
+	loop {
+		if k == BUDDY_NORDER {
+			break;
+		}
+		kputs("order ");
+		kputd(k);
+		kputs(": ");
+		kputd(b.nfree[k]);
+		kputs(" free, ");
+		kputd(b.nalloc[k]);
+		kputs(" allocated\n");
+		k = k + 1;
+	}
+}
+
+page_ref(pa: int): *int {
+	var z: *buddy_zone;
+	z = buddy_zone(pa);
+	return &z.ref[(pa - z.start) >> 12];
+}
+
+// Count another page table mapping the page at pa
+page_get(pa: int) {
+	var flags: int;
+	var r: *int;
+
+	flags = rdflags();
+	cli();
+	r = page_ref(pa);
+	*r = *r + 1;
+	wrflags(flags);
+}
+
+// Drop a mapping of the page at pa, freeing the page with the last one
+page_put(pa: int) {
+	var flags: int;
+	var r: *int;
+
+	flags = rdflags();
+	cli();
+	r = page_ref(pa);
+	if *r == 0 {
+		free_pages(pa, 0);
+	} else {
+		*r = *r - 1;
+	}
+	wrflags(flags);
+}
+
+free(p: *byte) {
+	if !p {
+		return;
+	}
 
-	kdie("OOM");
+	free_pages(vtop(p), 0);
+}
+
+alloc_page(): int {
+	return alloc_pages(0);
 }
 
 direct_map(brk: *int) {
@@ -1084,7 +1523,7 @@ direct_map(brk: *int) {
 			}
 
 			i = (va >> 30) & 511;
-			pt3[i] = pa | 0x083;
+			pt3[i] = pa | 0x083 | PTE_G;
 
 			va = va + page_size;
 			pa = pa + page_size;
@@ -1092,46 +1531,131 @@ direct_map(brk: *int) {
 		}
 	}
 
+	// So is the kernel image, mapped at boot
+	pt3 = ptov(pt4[511] & -4096):*int;
+	pt3[510] = pt3[510] | PTE_G;
+
 	invlpt();
 }
 
-invlpt() {
+// Kernel mappings are global, so they stay in the TLB across address space
+// switches. The kernel half of the top level table is filled in by boot and
+// direct_map before there are tasks, and only the tables below it change
+// later, so each task's table gets a copy of it once when it is made.
+//
+// Where the CPU has PCIDs, each task is tagged with one and loading its
+// table keeps the TLB entries of the others. pcid_task records which task
+// last used each PCID; a task that finds its PCID taken over, as happens
+// when they wrap, flushes its entries on the way in.
+enum {
+	PTE_G = 0x100,
+
+	CR4_PGE = 0x80,
+	CR4_PCIDE = 0x20000,
+
+	PCID_COUNT = 4096,
+}
+
+setup_pcid() {
 	var global: *global;
-	var t: *task;
-	var tpt: *int;
-	var kpt: *int;
-	var i: int;
+	var a: int;
+	var b: int;
+	var c: int;
+	var d: int;
+
 	global = g();
-	t = global.curtask;
-	if t.pt == global.kpt {
-		wrcr3(global.kpt);
+
+	a = 1;
+	c = 0;
+	cpuid(&a, &c, &d, &b);
+	if !(c & (1 << 17)) {
 		return;
 	}
-	tpt = ptov(t.pt):*int;
-	kpt = ptov(global.kpt):*int;
-	i = 256;
-	loop {
-		if i == 512 {
-			break;
-		}
-		tpt[i] = kpt[i];
-		i = i + 1;
-	}
-	wrcr3(t.pt);
-}
 
-setup_ring(ring: int, own: int) {
-	var v: *byte;
-	var i: int;
-	var p: int;
+	global.pcid_task = ptov(alloc_pages(3)):**task;
+	bzero(global.pcid_task:*byte, PCID_COUNT * sizeof(*global.pcid_task));
 
-	v = ptov(ring);
-	i = 0;
+	wrcr4(rdcr4() | CR4_PCIDE);
+}
 
-	loop {
-		if i == 16 {
-			break;
-		}
+// A table with an empty user half and the kernel half shared
+newpt(): int {
+	var pt: int;
+
+	pt = alloc_page();
+	bzero(ptov(pt), 2048);
+	share_kernel(pt);
+
+	return pt;
+}
+
+share_kernel(pt: int) {
+	var global: *global;
+	var p: *byte;
+	var k: *byte;
+
+	global = g();
+
+	p = ptov(pt);
+	k = ptov(global.kpt);
+	memcpy(&p[2048], &k[2048], 2048);
+}
+
+// Switch to the table of the current task. flush drops what the TLB holds
+// for its user half, for when the task has changed its mappings.
+loadpt(flush: int) {
+	var global: *global;
+	var t: *task;
+
+	global = g();
+	t = global.curtask;
+
+	if t.pt == global.kpt || !global.pcid_task {
+		wrcr3(t.pt);
+		return;
+	}
+
+	if global.pcid_task[t.pcid] != t {
+		global.pcid_task[t.pcid] = t;
+		flush = 1;
+	}
+
+	if flush {
+		wrcr3(t.pt | t.pcid);
+	} else {
+		wrcr3(t.pt | t.pcid | (1 << 63));
+	}
+}
+
+// Give a new task a PCID, which it may share with an older one
+newpcid(t: *task) {
+	var global: *global;
+	global = g();
+	global.next_pcid = global.next_pcid % (PCID_COUNT - 1) + 1;
+	t.pcid = global.next_pcid;
+}
+
+// Flush the whole TLB, global entries included, after a change to the
+// kernel half of the page tables
+invlpt() {
+	var cr4: int;
+	cr4 = rdcr4();
+	wrcr4(cr4 & ~CR4_PGE);
+	wrcr4(cr4);
+}
+
+setup_ring(ring: int, own: int) {
+	var v: *byte;
+	var i: int;
+	var p: int;
+
+	v = ptov(ring);
+	i = 0;
+
+	loop {
+		if i == 16 {
+			break;
+		}
 
 		p = alloc_page();
 
@@ -1168,6 +1692,222 @@ alloc(): *byte {
 	return ptov(alloc_page());
 }
 
+// kmalloc serves small objects from slabs, which are pages cut into
+// objects of one size class, 16 to 1024 bytes. The slab header sits at the
+// start of its page, so kfree finds it by rounding the pointer down, and
+// a page-aligned pointer is a whole page from alloc. Slabs with free
+// objects are kept on a list per class and an empty slab goes back to the
+// page allocator unless it is the last one of its class.
+enum {
+	KM_NCLASS = 7,
+	KM_MAXSMALL = 1024,
+}
+
+struct slab {
+	next: *slab;
+	prev: *slab;
+	free: **byte;
+	class: int;
+	inuse: int;
+}
+
+struct kcache {
+	slabs: *slab;
+	size: int;
+	nobj: int;
+	nslab: int;
+}
+
+setup_kmalloc() {
+	var global: *global;
+	var k: int;
+
+	global = g();
+
+	global.kcache = alloc():*kcache;
+
+	k = 0;
+	loop {
+		if k == KM_NCLASS {
+			break;
+		}
+		global.kcache[k].slabs = 0:*slab;
+		global.kcache[k].size = 16 << k;
+		global.kcache[k].nobj = 0;
+		global.kcache[k].nslab = 0;
+		k = k + 1;
+	}
+}
+
+kmalloc_slab(k: int): *slab {
+	var global: *global;
+	var s: *slab;
+	var size: int;
+	var off: int;
+	var b: *byte;
+	var p: **byte;
+
+	global = g();
+
+	b = alloc();
+	s = b:*slab;
+	s.next = 0:*slab;
+	s.prev = 0:*slab;
+	s.free = 0:**byte;
+	s.class = k;
+	s.inuse = 0;
+
+	// Objects start after the header at a multiple of their size
+	size = global.kcache[k].size;
+	off = (sizeof(*s) + size - 1) & -size;
+	loop {
+		if off + size > 4096 {
+			break;
+		}
+		p = (&b[off]):**byte;
+		*p = s.free:*byte;
+		s.free = p;
+		off = off + size;
+	}
+
+	global.kcache[k].nslab = global.kcache[k].nslab + 1;
+
+	return s;
+}
+
+kmalloc(size: int): *byte {
+	var global: *global;
+	var c: *kcache;
+	var s: *slab;
+	var p: **byte;
+	var k: int;
+	var flags: int;
+
+	if size > KM_MAXSMALL {
+		if size > 4096 {
+			kdie("kmalloc too large");
+		}
+		return alloc();
+	}
+
+	k = 0;
+	loop {
+		if (16 << k) >= size {
+			break;
+		}
+		k = k + 1;
+	}
+
+	global = g();
+	c = &global.kcache[k];
+
+	flags = rdflags();
+	cli();
+
+	s = c.slabs;
+	if !s {
+		s = kmalloc_slab(k);
+		c.slabs = s;
+	}
+
+	p = s.free;
+	s.free = (*p):**byte;
+	s.inuse = s.inuse + 1;
+	c.nobj = c.nobj + 1;
+
+	// A full slab leaves the list until an object is freed
+	if !s.free {
+		c.slabs = s.next;
+		if s.next {
+			s.next.prev = 0:*slab;
+		}
+		s.next = 0:*slab;
+	}
+
+	wrflags(flags);
+
+	return p:*byte;
+}
+
+kfree(p: *byte) {
+	var global: *global;
+	var c: *kcache;
+	var s: *slab;
+	var q: **byte;
+	var flags: int;
+
+	if !p {
+		return;
+	}
+
+	if p:int & 4095 == 0 {
+		free(p);
+		return;
+	}
+
+	global = g();
+	s = (p:int & -4096):*slab;
+	c = &global.kcache[s.class];
+
+	flags = rdflags();
+	cli();
+
+	// A full slab goes back on the list
+	if !s.free {
+		s.prev = 0:*slab;
+		s.next = c.slabs;
+		if c.slabs {
+			c.slabs.prev = s;
+		}
+		c.slabs = s;
+	}
+
+	q = p:**byte;
+	*q = s.free:*byte;
+	s.free = q;
+	s.inuse = s.inuse - 1;
+	c.nobj = c.nobj - 1;
+
+	if s.inuse == 0 && (s.prev || s.next) {
+		if s.prev {
+			s.prev.next = s.next;
+		} else {
+			c.slabs = s.next;
+		}
+		if s.next {
+			s.next.prev = s.prev;
+		}
+		c.nslab = c.nslab - 1;
+		free(s:*byte);
+	}
+
+	wrflags(flags);
+}
+
+// Print the objects in use and slab pages of each class. Not called on the
+// normal path; call it when debugging the allocator.
+kmstat() {
+	var global: *global;
+	var k: int;
+
+	global = g();
+
+	k = 0;
+	loop {
+		if k == KM_NCLASS {
+			break;
+		}
+		kputs("kmalloc ");
+		kputd(global.kcache[k].size);
+		kputs(": ");
+		kputd(global.kcache[k].nobj);
+		kputs(" objects in ");
+		kputd(global.kcache[k].nslab);
+		kputs(" pages\n");
+		k = k + 1;
+	}
+}
+
 realtek_mkring(ring: *realtek_ring, rx: int) {
 	var i: int;
 	ring.count = 4096 >> 4;
@@ -1493,6 +2233,8 @@ struct txinfo {
 	tcp_opt_len: int;
 }
 
+// A packet takes a whole page: the struct, then room for the headers that
+// are prepended to the payload at buf.
 alloc_tx(): *txinfo {
 	var pkt: *txinfo;
 	pkt = alloc():*txinfo;
@@ -2131,7 +2873,7 @@ alloc_tcp(): *tcp_state {
 		}
 
 		if !global.tcp[i] {
-			tcb = alloc():*tcp_state;
+			tcb = kmalloc(sizeof(*tcb)):*tcp_state;
 			bzero(tcb:*byte, sizeof(*tcb));
 			tcb.recv_buf = alloc();
 			tcb.send_buf = alloc();
@@ -2164,7 +2906,7 @@ tcp_free(tcb: *tcp_state) {
 	}
 	free(tcb.send_buf);
 	free(tcb.recv_buf);
-	free(tcb:*byte);
+	kfree(tcb:*byte);
 	wrflags(flags);
 }
 
@@ -2207,17 +2949,43 @@ tcp_echo(tcb: *tcp_state) {
 	free(buf);
 }
 
+// Sleep until the connection has handled a segment since event seen, and
+// return the latest event
+tcp_wait(tcb: *tcp_state, seen: int): int {
+	var flags: int;
+
+	flags = rdflags();
+	cli();
+
+	loop {
+		if tcb.nevent != seen {
+			break;
+		}
+		sleep_on(&tcb.wait);
+	}
+	seen = tcb.nevent;
+
+	wrflags(flags);
+
+	return seen;
+}
+
 task_ssh(t: *task) {
 	var tcb: *tcp_state;
 	var buf: *byte;
 	var c: byte;
 	var n: int;
 	var m: int;
+	var o: int;
+	var seen: int;
+	var s: int;
 	tcb = t.a:*tcp_state;
 	kputs("accept\n");
 	buf = alloc();
+	// Look at the connection once before waiting
+	seen = -1;
 	loop {
-		yield();
+		seen = tcp_wait(tcb, seen);
 		if tcb.state == TCP_CLOSED {
 			kputs("closed\n");
 			tcp_free(tcb);
@@ -2233,15 +3001,23 @@ task_ssh(t: *task) {
 			continue;
 		}
 
-		// echo
+		// echo, waiting for acks to make room when the send buffer is full
 		n = tcp_recv(tcb, buf, 4096);
+		o = 0;
 		loop {
-			m = tcp_send(tcb, buf, n);
-			if n == 0 || m < 0 {
+			if n == 0 {
+				break;
+			}
+			s = tcb.nevent;
+			m = tcp_send(tcb, &buf[o], n);
+			if m < 0 {
 				break;
 			}
+			if m == 0 {
+				tcp_wait(tcb, s);
+			}
 			n = n - m;
-			memcpy(buf, &buf[n], n);
+			o = o + m;
 		}
 	}
 	free(buf);
@@ -2712,6 +3488,8 @@ handle_tcp(pkt: *rxinfo) {
 		send_rst(pkt);
 	} else {
 		handle_seg(tcb, pkt);
+		tcb.nevent = tcb.nevent + 1;
+		wake_up(&tcb.wait);
 		if tcb.state != TCP_LISTEN {
 			tcb.event_func(tcb);
 		}
@@ -3161,14 +3939,13 @@ tick(r: *regs) {
 		tcb = global.tcp[i];
 		if tcb {
 			tcp_tick(tcb);
-			if tcb.state != TCP_LISTEN {
-				tcb.event_func(tcb);
-			}
 		}
 
 		i = i + 1;
 	}
 
+	wake_timers();
+
 	// round robin schedule
 	cur = global.curtask;
 	memcpy((&cur.regs):*byte, r:*byte, sizeof(*r));
@@ -3179,12 +3956,42 @@ tick(r: *regs) {
 	memcpy(r:*byte, (&next.regs):*byte, sizeof(*r));
 }
 
+// Free a page table with the user half of the address space it maps. The
+// kernel half is shared with every other table.
 freept(pt: int) {
-	free(ptov(pt));
+	freept_level(pt, 3, 256);
+}
+
+freept_level(pt: int, level: int, n: int) {
+	var p: *int;
+	var i: int;
+
+	p = ptov(pt):*int;
+
+	i = 0;
+	loop {
+		if i == n {
+			break;
+		}
+
+		if p[i] & PTE_P {
+			if level > 0 {
+				freept_level(p[i] & -4096, level - 1, 512);
+			} else if !(p[i] & PTE_FILE) {
+				page_put(p[i] & -4096);
+			}
+		}
+
+		i = i + 1;
+	}
+
+	free_pages(pt, 0);
 }
 
 free_task(t: *task) {
+	var global: *global;
 	var i: int;
+	global = g();
 	i = 0;
 	loop {
 		if i == 512 {
@@ -3197,7 +4004,11 @@ free_task(t: *task) {
 		i = i + 1;
 	}
 	vclose(t.cwd);
+	vma_free(t.vma);
 	freept(t.pt);
+	if global.pcid_task && global.pcid_task[t.pcid] == t {
+		global.pcid_task[t.pcid] = 0:*task;
+	}
 	free(t.stack);
 	free(t:*byte);
 }
@@ -3210,34 +4021,245 @@ schedule() {
 	var dead: *task;
 	global = g();
 
+	// Take the next task that can run, passing over sleeping ones and the
+	// idle task, which only runs when there is nothing else. Dead tasks are
+	// freed on the way unless they are zombies waiting for their parent.
 	cur = global.curtask;
 	next = cur.next;
 	loop {
-		if !next.dead {
+		if next == cur {
+			if cur.dead || cur.sleeping {
+				next = global.idle;
+			}
 			break;
 		}
-		dead = next;
-		next = dead.next;
-		prev = dead.prev;
-		if dead == cur {
+
+		if next.dead {
+			if task_zombie(next) {
+				next = next.next;
+				continue;
+			}
+
+			dead = next;
+			next = dead.next;
+			prev = dead.prev;
+			prev.next = next;
+			next.prev = prev;
+			free_task(dead);
 			continue;
 		}
-		prev.next = next;
-		next.prev = prev;
-		free_task(dead);
+
+		if !next.sleeping && next != global.idle {
+			break;
+		}
+
+		next = next.next;
 	}
 	global.curtask = next;
-	invlpt();
+	loadpt(0);
+}
+
+// Sleep on q until woken. Interrupts must be disabled.
+sleep_on(q: *waitq) {
+	var global: *global;
+	var t: *task;
+
+	global = g();
+	t = global.curtask;
+
+	t.sleeping = 1;
+	t.wnext = q.head;
+	q.head = t;
+
+	loop {
+		yield();
+		if !t.sleeping {
+			break;
+		}
+
+		// Only the idle task comes back asleep, as no other task could run
+		sti();
+		hlt();
+		cli();
+	}
+}
+
+// Wake every task sleeping on q
+wake_up(q: *waitq) {
+	var flags: int;
+	var t: *task;
+	var next: *task;
+
+	flags = rdflags();
+	cli();
+
+	t = q.head;
+	q.head = 0:*task;
+	loop {
+		if !t {
+			break;
+		}
+		next = t.wnext;
+		t.wnext = 0:*task;
+		t.sleeping = 0;
+		t = next;
+	}
+
+	wrflags(flags);
+}
+
+// Wake the tasks in sleep whose deadline has passed. Called from the timer
+// interrupt.
+wake_timers() {
+	var global: *global;
+	var link: **task;
+	var t: *task;
+
+	global = g();
+
+	link = &global.timers.head;
+	loop {
+		t = *link;
+		if !t {
+			break;
+		}
+
+		if global.ms > t.deadline {
+			*link = t.wnext;
+			t.wnext = 0:*task;
+			t.sleeping = 0;
+		} else {
+			link = &t.wnext;
+		}
+	}
 }
 
-task_exit() {
+task_find(pid: int): *task {
 	var global: *global;
 	var t: *task;
+
 	global = g();
+
 	t = global.curtask;
+	loop {
+		if t.pid == pid && !t.dead {
+			return t;
+		}
+		t = t.next;
+		if t == global.curtask {
+			return 0:*task;
+		}
+	}
+}
+
+enum {
+	WNOHANG = 1,
+}
+
+// A task that has exited stays around as a zombie holding its exit status
+// until its parent collects it with wait, unless the parent is gone.
+task_zombie(t: *task): int {
+	if !t.dead || t.reaped || !t.ppid {
+		return 0;
+	}
+
+	if !task_find(t.ppid) {
+		return 0;
+	}
+
+	return 1;
+}
+
+// The child of the current task that wait selects with pid: that child if
+// pid is positive, or any child if pid is -1. One that has exited is
+// preferred over one that is still running.
+task_child(pid: int): *task {
+	var global: *global;
+	var t: *task;
+	var live: *task;
+
+	global = g();
+
+	live = 0:*task;
+	t = global.curtask.next;
+	loop {
+		if t == global.curtask {
+			return live;
+		}
+
+		if t.ppid == global.curtask.pid && !t.reaped
+				&& (pid == -1 || t.pid == pid) {
+			if t.dead {
+				return t;
+			}
+			live = t;
+		}
+
+		t = t.next;
+	}
+}
+
+// Sleep until the child that pid selects has exited, store its exit
+// status and return its pid. With WNOHANG, return 0 at once if the child
+// is still running.
+task_wait(pid: int, status: *byte, options: int): int {
+	var global: *global;
+	var t: *task;
+	var flags: int;
+	var st: int;
+
+	global = g();
+
+	if status && (status:int < 0 || status:int > (1 << 47) - 4) {
+		return -1;
+	}
+
+	flags = rdflags();
 	cli();
+
+	loop {
+		t = task_child(pid);
+		if !t {
+			wrflags(flags);
+			return -1;
+		}
+
+		if t.dead {
+			break;
+		}
+
+		if options & WNOHANG {
+			wrflags(flags);
+			return 0;
+		}
+
+		sleep_on(&global.exits);
+	}
+
+	t.reaped = 1;
+	pid = t.pid;
+	st = t.status;
+
+	wrflags(flags);
+
+	if status {
+		_w32(status, st);
+	}
+
+	return pid;
+}
+
+// Exit with a status as wait reports it: the exit code in bits 8 to 15.
+task_exit(status: int) {
+	var global: *global;
+	var t: *task;
+	global = g();
+	t = global.curtask;
+	cli();
+	t.status = status;
+	t.dead = 1;
+	wake_up(&global.exits);
 	loop {
-		t.dead = 1;
 		yield();
 	}
 }
@@ -3271,7 +4293,8 @@ kdie(msg: *byte) {
 
 sleep(ms: int) {
 	var global: *global;
-	var deadline: int;
+	var t: *task;
+	var flags: int;
 
 	global = g();
 
@@ -3283,13 +4306,19 @@ sleep(ms: int) {
 		kdie("attempt to sleep with interrupts disabled");
 	}
 
-	deadline = global.ms + ms;
+	flags = rdflags();
+	cli();
+
+	t = global.curtask;
+	t.deadline = global.ms + ms;
 	loop {
-		if global.ms > deadline {
+		if global.ms > t.deadline {
 			break;
 		}
-		hlt();
+		sleep_on(&global.timers);
 	}
+
+	wrflags(flags);
 }
 
 xxd(data: *byte, len: int) {
@@ -3479,7 +4508,7 @@ _tstart() {
 	t = global.curtask;
 	sti();
 	t.f(t);
-	task_exit();
+	task_exit(0);
 }
 
 spawn(f: (func(t: *task)), name: *byte, a: *void): *task {
@@ -3502,10 +4531,12 @@ spawn(f: (func(t: *task)), name: *byte, a: *void): *task {
 	t.regs.ss = 16;
 	t.f = f;
 	t.a = a;
-	t.pt = alloc_page();
-	bzero(ptov(t.pt), 4096);
+	t.pt = newpt();
 	flags = rdflags();
 	cli();
+	newpcid(t);
+	global.next_pid = global.next_pid + 1;
+	t.pid = global.next_pid;
 	cur = global.curtask;
 	t.cwd = vdup(cur.cwd);
 	next = cur.next;
@@ -3517,6 +4548,66 @@ spawn(f: (func(t: *task)), name: *byte, a: *void): *task {
 	return t;
 }
 
+// Start a copy of the current process that returns 0 from the system call
+// with frame r, and return its pid. The child gets its own page table with
+// the parent's pages shared copy-on-write, and shares its open files.
+fork(r: *regs): int {
+	var global: *global;
+	var cur: *task;
+	var t: *task;
+	var next: *task;
+	var flags: int;
+	var i: int;
+
+	global = g();
+	cur = global.curtask;
+
+	t = alloc():*task;
+	bzero(t:*byte, sizeof(*t));
+	t.files = alloc(): **vfile;
+	bzero(t.files:*byte, 4096);
+	t.stack = alloc();
+	bzero(t.stack, 4096);
+	t.name = cur.name;
+
+	i = 0;
+	loop {
+		if i == 512 {
+			break;
+		}
+		if cur.files[i] {
+			t.files[i] = vdup(cur.files[i]);
+		}
+		i = i + 1;
+	}
+
+	memcpy((&t.regs):*byte, r:*byte, sizeof(*r));
+	t.regs.rax = 0;
+
+	flags = rdflags();
+	cli();
+
+	t.vma = vma_dup(cur.vma);
+	t.pt = forkpt(cur.pt);
+
+	// The parent's pages are read-only now too
+	loadpt(1);
+
+	newpcid(t);
+	global.next_pid = global.next_pid + 1;
+	t.pid = global.next_pid;
+	t.ppid = cur.pid;
+	t.cwd = vdup(cur.cwd);
+	next = cur.next;
+	t.next = next;
+	t.prev = cur;
+	cur.next = t;
+	next.prev = t;
+	wrflags(flags);
+
+	return t.pid;
+}
+
 enum {
 	O_RDONLY = 0,
 	O_WRONLY = 1,
@@ -3525,17 +4616,34 @@ enum {
 	O_DIRECTORY = 0x1000,
 }
 
-struct vpage {
-	parent: *vpage;
-	left: *vpage;
-	right: *vpage;
-	offset: int;
-	page: *byte;
+// The pages of a file are indexed by a radix tree, like the CPU's page
+// tables. Each node holds VRADIX pointers, to pages at the bottom level and
+// to nodes above it, so a tree of depth d covers VRADIX^d pages. The tree
+// grows a level at the top when a write goes past the end of it.
+//
+// A page slot with VPAGE_SHARED set points into memory the file does not
+// own, such as the initramfs in the kernel image. The page is copied on
+// the first write and never freed.
+enum {
+	VRADIX_SHIFT = 6,
+	VRADIX = 64,
+	VPAGE_SHARED = 1,
+}
+
+// Directory entries are kept on a list, newest first, and in a hash table
+// keyed by name, which doubles when it holds as many entries as buckets, up
+// to a page of buckets. Rebuilding the table leaves the list alone.
+enum {
+	VENT_MINBUCKET = 8,
+	VENT_MAXBUCKET = 512,
 }
 
 struct vent {
 	next: *vent;
+	hnext: *vent;
 	name: *byte;
+	nlen: int;
+	hash: int;
 	node: *vnode;
 }
 
@@ -3544,8 +4652,12 @@ struct vnode {
 	ino: int;
 	nlink: int;
 	size: int;
-	pages: *vpage;
+	pages: **byte;
+	depth: int;
 	ents: *vent;
+	buckets: **vent;
+	nbucket: int;
+	nent: int;
 }
 
 struct vfile {
@@ -3561,11 +4673,38 @@ enum {
 	S_IFREG = 0x8000,
 }
 
+// Same as in lib.c: scan aligned words for a zero byte.
 strlen(s: *byte): int {
 	var i: int;
+	var x: int;
+	var ones: int;
+	var highs: int;
+
 	i = 0;
 	loop {
-		if !s[i] {
+		if (((s:int + i) & 7) == 0) {
+			break;
+		}
+		if (s[i] == 0:byte) {
+			return i;
+		}
+		i = i + 1;
+	}
+
+	ones = 0x01010101;
+	ones = ones | (ones << 32);
+	highs = ones << 7;
+
+	loop {
+		x = *((&s[i]):*int);
+		if ((x - ones) & ~x & highs) {
+			break;
+		}
+		i = i + 8;
+	}
+
+	loop {
+		if (s[i] == 0:byte) {
 			return i;
 		}
 		i = i + 1;
@@ -3577,7 +4716,7 @@ strndup(s: *byte, n: int): *byte {
 	if n >= 4096 {
 		kdie("str too large");
 	}
-	r = alloc();
+	r = kmalloc(n + 1);
 	memcpy(r, s, n);
 	r[n] = 0:byte;
 	return r;
@@ -3591,14 +4730,18 @@ mkvnode(): *vnode {
 	var v: *vnode;
 	var global: *global;
 	global = g();
-	v = alloc():*vnode;
+	v = kmalloc(sizeof(*v)):*vnode;
 	v.refcount = 1;
 	global.next_ino = global.next_ino + 1;
 	v.nlink = 0;
 	v.ino = global.next_ino;
 	v.size = 0;
-	v.pages = 0:*vpage;
+	v.pages = 0:**byte;
+	v.depth = 0;
 	v.ents = 0:*vent;
+	v.buckets = 0:**vent;
+	v.nbucket = 0;
+	v.nent = 0;
 	return v;
 }
 
@@ -3607,7 +4750,7 @@ mkfile(v: *vnode, mode: int): *vfile {
 	if !v {
 		v = mkvnode();
 	}
-	f = alloc():*vfile;
+	f = kmalloc(sizeof(*f)):*vfile;
 	f.refcount = 1;
 	f.mode = mode;
 	f.offset = 0;
@@ -3623,22 +4766,73 @@ mkroot(): *vfile {
 	return f;
 }
 
+ehash(name: *byte, nlen: int): int {
+	var h: int;
+	var i: int;
+
+	h = 5381;
+	i = 0;
+	loop {
+		if i == nlen {
+			break;
+		}
+		h = (h << 5) + h + name[i]:int;
+		i = i + 1;
+	}
+
+	return h & 0x7fffffff;
+}
+
 efind(d: *vfile, name: *byte, nlen: int): *vent {
+	var v: *vnode;
 	var e: *vent;
-	e = d.node.ents;
+	var h: int;
+
+	v = d.node;
+	if !v.nbucket {
+		return 0:*vent;
+	}
+
+	h = ehash(name, nlen);
+
+	e = v.buckets[h & (v.nbucket - 1)];
 	loop {
 		if !e {
 			break;
 		}
-		if strlen(e.name) == nlen && !memcmp(e.name, name, nlen) {
+		if e.hash == h && e.nlen == nlen && !memcmp(e.name, name, nlen) {
 			break;
 		}
-		e = e.next;
+		e = e.hnext;
 	}
 	return e;
 }
 
+// Rebuild the hash table of v with n buckets
+erehash(v: *vnode, n: int) {
+	var e: *vent;
+	var i: int;
+
+	kfree(v.buckets:*byte);
+
+	v.buckets = kmalloc(n * sizeof(*v.buckets)):**vent;
+	v.nbucket = n;
+	bzero(v.buckets:*byte, n * sizeof(*v.buckets));
+
+	e = v.ents;
+	loop {
+		if !e {
+			break;
+		}
+		i = e.hash & (n - 1);
+		e.hnext = v.buckets[i];
+		v.buckets[i] = e;
+		e = e.next;
+	}
+}
+
 vlink(d: *vfile, name: *byte, nlen: int, f: *vfile) {
+	var v: *vnode;
 	var e: *vent;
 	e = efind(d, name, nlen);
 	if e {
@@ -3646,12 +4840,25 @@ vlink(d: *vfile, name: *byte, nlen: int, f: *vfile) {
 		e.node.nlink = e.node.nlink - 1;
 		e.node = vnodedup(f.node);
 	} else {
-		e = alloc():*vent;
+		e = kmalloc(sizeof(*e)):*vent;
 		e.name = strndup(name, nlen);
+		e.nlen = nlen;
+		e.hash = ehash(name, nlen);
 		e.node = vnodedup(f.node);
 		f.node.nlink = f.node.nlink + 1;
 		e.next = d.node.ents;
 		d.node.ents = e;
+
+		v = d.node;
+		v.nent = v.nent + 1;
+		if !v.nbucket {
+			erehash(v, VENT_MINBUCKET);
+		} else if v.nent > v.nbucket && v.nbucket < VENT_MAXBUCKET {
+			erehash(v, v.nbucket * 2);
+		} else {
+			e.hnext = v.buckets[e.hash & (v.nbucket - 1)];
+			v.buckets[e.hash & (v.nbucket - 1)] = e;
+		}
 	}
 	if nlen != 2 || memcmp(name, "..", 2) {
 		vlink(f, "..", 2, d);
@@ -3761,40 +4968,33 @@ vopen(name: *byte, flags: int, mode: int): *vfile {
 	return f;
 }
 
-vrelease_page(p: *vpage) {
-	var q: *vpage;
+vrelease_pages(node: **byte, depth: int) {
+	var i: int;
+
+	if !node {
+		return;
+	}
 
+	i = 0;
 	loop {
-		if !p {
+		if i == VRADIX {
 			break;
 		}
 
-		if p.left {
-			p = p.left;
-			continue;
-		}
-
-		if p.right {
-			p = p.right;
-			continue;
-		}
-
-		q = p.parent;
-		if q {
-			if q.left == p {
-				q.left = 0:*vpage;
+		if node[i] {
+			if depth == 1 {
+				if !(node[i]:int & VPAGE_SHARED) {
+					free(node[i]);
+				}
 			} else {
-				q.right = 0:*vpage;
+				vrelease_pages(node[i]:**byte, depth - 1);
 			}
 		}
 
-		p.parent = 0:*vpage;
-
-		free(p.page);
-		free(p:*byte);
-
-		p = q;
+		i = i + 1;
 	}
+
+	kfree(node:*byte);
 }
 
 vrelease(v: *vnode): int {
@@ -3811,12 +5011,13 @@ vrelease(v: *vnode): int {
 		}
 		n = e.next;
 		vrelease(e.node);
-		free(e.name);
-		free(e:*byte);
+		kfree(e.name);
+		kfree(e:*byte);
 		e = n;
 	}
-	vrelease_page(v.pages);
-	free(v:*byte);
+	kfree(v.buckets:*byte);
+	vrelease_pages(v.pages, v.depth);
+	kfree(v:*byte);
 	return 0;
 }
 
@@ -3834,7 +5035,7 @@ vclose(f: *vfile): int {
 
 	n = f.node;
 
-	free(f:*byte);
+	kfree(f:*byte);
 
 	return vrelease(n);
 }
@@ -3855,76 +5056,94 @@ vseek(f: *vfile, o: int, w: int): int {
 	return f.offset;
 }
 
-vwrite_page(v: *vnode, o: int, b: *byte, n: int): int {
-	var key: int;
-	var p: *vpage;
-	var q: *vpage;
+vradix_new(): **byte {
+	var node: **byte;
+	node = kmalloc(VRADIX * sizeof(*node)):**byte;
+	bzero(node:*byte, VRADIX * sizeof(*node));
+	return node;
+}
+
+// Find the slot for page index in the tree of v. If create is set, missing
+// nodes are added on the way, otherwise 0 is returned for a hole.
+vpage_slot(v: *vnode, index: int, create: int): **byte {
+	var node: **byte;
+	var shift: int;
+	var i: int;
+
+	loop {
+		if v.depth > 0 && (index >> (v.depth * VRADIX_SHIFT)) == 0 {
+			break;
+		}
+
+		if !create {
+			return 0:**byte;
+		}
+
+		node = vradix_new();
+		node[0] = v.pages:*byte;
+		v.pages = node;
+		v.depth = v.depth + 1;
+	}
+
+	node = v.pages;
+	shift = (v.depth - 1) * VRADIX_SHIFT;
+	loop {
+		if shift == 0 {
+			return &node[index & (VRADIX - 1)];
+		}
+
+		i = (index >> shift) & (VRADIX - 1);
+		if !node[i] {
+			if !create {
+				return 0:**byte;
+			}
+			node[i] = vradix_new():*byte;
+		}
 
-	if o + n > v.size {
-		v.size = o + n;
+		node = node[i]:**byte;
+		shift = shift - VRADIX_SHIFT;
 	}
+}
+
+vwrite_page(v: *vnode, o: int, b: *byte, n: int): int {
+	var slot: **byte;
+	var page: *byte;
+	var key: int;
+	var m: int;
 
 	key = o & -4096;
+	slot = vpage_slot(v, o >> 12, 1);
 	o = o & 4095;
 
 	if n > 4096 - o {
 		n = 4096 - o;
 	}
 
-	p = v.pages;
-	if !p {
-		q = alloc(): *vpage;
-		q.parent = 0:*vpage;
-		q.left = 0:*vpage;
-		q.right = 0:*vpage;
-		q.offset = key;
-		q.page = alloc();
-		bzero(q.page, 4096);
-		v.pages = q;
-		p = q;
+	if !*slot {
+		*slot = alloc();
+		bzero(*slot, 4096);
+	} else if (*slot):int & VPAGE_SHARED {
+		// Copy what belongs to the file, the rest of the page reads as zero
+		m = v.size - key;
+		if m > 4096 {
+			m = 4096;
+		}
+		page = alloc();
+		memcpy(page, ((*slot):int & ~VPAGE_SHARED):*byte, m);
+		bzero(&page[m], 4096 - m);
+		*slot = page;
 	}
 
-	loop {
-		if key < p.offset {
-			if !p.left {
-				q = alloc(): *vpage;
-				q.parent = p;
-				q.left = 0:*vpage;
-				q.right = 0:*vpage;
-				q.offset = key;
-				q.page = alloc();
-				bzero(q.page, 4096);
-				p.left = q;
-				p = q;
-			} else {
-				p = p.left;
-			}
-		} else if key > p.offset {
-			if ! p.right {
-				q = alloc(): *vpage;
-				q.parent = p;
-				q.left = 0:*vpage;
-				q.right = 0:*vpage;
-				q.offset = key;
-				q.page = alloc();
-				bzero(q.page, 4096);
-				p.right = q;
-				p = q;
-			} else {
-				p = p.right;
-			}
-		} else {
-			break;
-		}
+	if key + o + n > v.size {
+		v.size = key + o + n;
 	}
 
-	memcpy(&p.page[o], b, n);
+	memcpy(&(*slot)[o], b, n);
 	return n;
 }
 
 vread_page(v: *vnode, o: int, b: *byte, n: int): int {
-	var key: int;
-	var p: *vpage;
+	var slot: **byte;
 
 	if o > v.size {
 		return 0;
@@ -3934,37 +5153,55 @@ vread_page(v: *vnode, o: int, b: *byte, n: int): int {
 		n = v.size - o;
 	}
 
-	key = o & -4096;
+	slot = vpage_slot(v, o >> 12, 0);
 	o = o & 4095;
 
 	if n > 4096 - o {
 		n = 4096 - o;
 	}
 
-	p = v.pages;
-	if !p {
-		return 0;
+	if !slot || !*slot {
+		bzero(b, n);
+	} else {
+		memcpy(b, &(((*slot):int & ~VPAGE_SHARED):*byte)[o], n);
+	}
+
+	return n;
+}
+
+// The page of v at index, for mapping into a process. A hole gets a zeroed
+// page so that every mapping of it sees the same one.
+vpage_get(v: *vnode, index: int): *byte {
+	var slot: **byte;
+
+	slot = vpage_slot(v, index, 1);
+	if !*slot {
+		*slot = alloc();
+		bzero(*slot, 4096);
 	}
 
+	return ((*slot):int & ~VPAGE_SHARED):*byte;
+}
+
+// Make the contents of an empty file size bytes at data, which must be page
+// aligned and outlive the file. The pages are shared until written to.
+vmap_shared(v: *vnode, data: *byte, size: int) {
+	var slot: **byte;
+	var o: int;
+
+	o = 0;
 	loop {
-		if !p {
-			break;
-		} else if key < p.offset {
-			p = p.left;
-		} else if key > p.offset {
-			p = p.right;
-		} else {
+		if o >= size {
 			break;
 		}
-	}
 
-	if !p {
-		bzero(b, n);
-	} else {
-		memcpy(b, &p.page[o], n);
+		slot = vpage_slot(v, o >> 12, 1);
+		*slot = ((&data[o]):int | VPAGE_SHARED):*byte;
+
+		o = o + 4096;
 	}
 
-	return n;
+	v.size = size;
 }
 
 vwrite(f: *vfile, b: *byte, n: int): int {
@@ -4070,8 +5307,9 @@ _ssr(r: *regs) {
 		kputs("fstat\n");
 		r.rax = -1;
 	} else if r.rax == 9 {
-		kputs("mmap\n");
-		r.rax = -1;
+		r.rax = vmmap(r.rdi, r.rsi, r.rdx, r.r10);
+	} else if r.rax == 11 {
+		r.rax = vmunmap(r.rdi, r.rsi);
 	} else if r.rax == 22 {
 		kputs("pipe\n");
 		r.rax = -1;
@@ -4091,8 +5329,7 @@ _ssr(r: *regs) {
 		kputs("listen\n");
 		r.rax = -1;
 	} else if r.rax == 57 {
-		kputs("fork\n");
-		r.rax = -1;
+		r.rax = fork(r);
 	} else if r.rax == 59 {
 		kputs("exec\n");
 		r.rax = -1;
@@ -4100,10 +5337,9 @@ _ssr(r: *regs) {
 		kputs("exit(");
 		kputd(r.rdi);
 		kputs(")\n");
-		task_exit();
+		task_exit((r.rdi & 255) << 8);
 	} else if r.rax == 61 {
-		kputs("wait\n");
-		r.rax = -1;
+		r.rax = task_wait(r.rdi, r.rsi:*byte, r.rdx);
 	} else if r.rax == 82 {
 		kputs("rename\n");
 		r.rax = -1;
@@ -4266,7 +5502,11 @@ initramfs_create(name: *byte, data: *byte, size: int, mode: int) {
 	} else if type == S_IFREG {
 		// regular file
 		f = vopen(name, O_CREAT, mode & 0xfff);
-		if f {
+		if f && f.node.size == 0 && (data:int & 4095) == 0 {
+			// cpio -a put the data on a page of its own
+			vmap_shared(f.node, data, size);
+			vclose(f);
+		} else if f {
 			n = 0;
 			loop {
 				if n == size {
@@ -4294,113 +5534,515 @@ userswitch(entry: int, stack: int) {
 	r.cs = 40 | 3;
 	r.rsp = stack;
 	r.ss = 32 | 3;
-	invlpt();
+	loadpt(1);
 	taskswitch(&discard, &r);
 }
 
+// User page table entries. A page mapped with PTE_FILE belongs to the page
+// cache of a file and is left alone when the table is freed. Such pages are
+// never mapped writable; vfault copies them on the first write.
+enum {
+	PTE_P = 1,
+	PTE_W = 2,
+	PTE_U = 4,
+	PTE_FILE = 0x200,
+
+	VMA_WRITE = 2,
+
+	USER_STACK_SIZE = 0x800000,
+
+	PROT_WRITE = 2,
+	MAP_FIXED = 0x10,
+	MAP_ANONYMOUS = 0x20,
+}
+
+// Find the last level entry for vaddr in the page table at pt, adding the
+// missing tables on the way if create is set.
+user_pte(pt: int, vaddr: int, create: int): *int {
+	var p: *int;
+	var shift: int;
+	var i: int;
+
+	p = ptov(pt):*int;
+	shift = 39;
+	loop {
+		if shift == 12 {
+			return &p[(vaddr >> 12) & 511];
+		}
+
+		i = (vaddr >> shift) & 511;
+		if !p[i] {
+			if !create {
+				return 0:*int;
+			}
+			p[i] = alloc_page() | 7;
+			bzero(ptov(p[i] & -4096), 4096);
+		}
+
+		p = ptov(p[i] & -4096):*int;
+		shift = shift - 9;
+	}
+}
+
 map_user(vaddr: int): *byte {
 	var global: *global;
-	var task: *task;
-	var pt: *int;
-	var i: int;
+	var pte: *int;
 
 	if (vaddr >> 47) != 0 || (vaddr & 4095) != 0 {
 		return 0: *byte;
 	}
 
 	global = g();
-	task = global.curtask;
 
-	pt = ptov(task.pt):*int;
+	pte = user_pte(global.curtask.pt, vaddr, 1);
+	if !*pte {
+		*pte = alloc_page() | 7;
+		bzero(ptov(*pte & -4096), 4096);
+		return ptov(*pte & -4096);
+	}
+
+	return 0:*byte;
+}
+
+// Add a range of memsz bytes at vaddr to the current task, the first filesz
+// of which are read from node at offset.
+vma_add(vaddr: int, memsz: int, flags: int, node: *vnode, offset: int, filesz: int): int {
+	var global: *global;
+	var v: *vma;
+	var start: int;
+	var end: int;
+
+	start = vaddr & -4096;
+	end = (vaddr + memsz + 4095) & -4096;
+
+	if vaddr < 4096 || memsz < 0 || end > (1 << 47) {
+		return -1;
+	}
+
+	global = g();
 
-	i = (vaddr >> 39) & 255;
-	if !pt[i] {
-		pt[i] = alloc_page() | 7;
-		bzero(ptov(pt[i] & -4096), 4096);
+	v = kmalloc(sizeof(*v)):*vma;
+	v.start = start;
+	v.end = end;
+	v.flags = flags;
+	v.node = node;
+	v.offset = offset - (vaddr - start);
+	v.filesz = filesz + (vaddr - start);
+	if !node {
+		v.filesz = 0;
+	} else {
+		vnodedup(node);
 	}
-	pt = ptov(pt[i] & -4096):*int;
 
-	i = (vaddr >> 30) & 511;
-	if !pt[i] {
-		pt[i] = alloc_page() | 7;
-		bzero(ptov(pt[i] & -4096), 4096);
+	v.next = global.curtask.vma;
+	global.curtask.vma = v;
+
+	return 0;
+}
+
+vma_free(v: *vma) {
+	var next: *vma;
+	loop {
+		if !v {
+			break;
+		}
+		next = v.next;
+		if v.node {
+			vrelease(v.node);
+		}
+		kfree(v:*byte);
+		v = next;
 	}
-	pt = ptov(pt[i] & -4096):*int;
+}
+
+// Free the pages mapped from start to end in the table at pt
+unmap_pages(pt: int, start: int, end: int) {
+	var pte: *int;
+	var a: int;
+
+	a = start;
+	loop {
+		if a >= end {
+			break;
+		}
+
+		pte = user_pte(pt, a, 0);
+		if !pte {
+			// No table, so nothing mapped up to the next 2MB
+			a = (a + (1 << 21)) & -(1 << 21);
+			continue;
+		}
+
+		if *pte & PTE_P {
+			if !(*pte & PTE_FILE) {
+				page_put(*pte & -4096);
+			}
+			*pte = 0;
+			invlpg(a);
+		}
 
-	i = (vaddr >> 21) & 511;
-	if !pt[i] {
-		pt[i] = alloc_page() | 7;
-		bzero(ptov(pt[i] & -4096), 4096);
+		a = a + 4096;
 	}
-	pt = ptov(pt[i] & -4096):*int;
+}
+
+// Remove start to end from the address space of the current task, trimming
+// or splitting the ranges that overlap it.
+vma_unmap(start: int, end: int) {
+	var global: *global;
+	var link: **vma;
+	var v: *vma;
+	var n: *vma;
+
+	global = g();
+
+	link = &global.curtask.vma;
+	loop {
+		v = *link;
+		if !v {
+			break;
+		}
+
+		if v.end <= start || v.start >= end {
+			link = &v.next;
+			continue;
+		}
+
+		if v.start >= start && v.end <= end {
+			*link = v.next;
+			v.next = 0:*vma;
+			vma_free(v);
+			continue;
+		}
 
-	i = (vaddr >> 12) & 511;
-	if !pt[i] {
-		pt[i] = alloc_page() | 7;
-		bzero(ptov(pt[i] & -4096), 4096);
-		return ptov(pt[i] & -4096);
+		if v.start < start && v.end > end {
+			// Keep the part past end as a range of its own
+			n = kmalloc(sizeof(*n)):*vma;
+			n.start = end;
+			n.end = v.end;
+			n.flags = v.flags;
+			n.node = v.node;
+			n.offset = v.offset + (end - v.start);
+			n.filesz = v.filesz - (end - v.start);
+			if n.filesz < 0 {
+				n.filesz = 0;
+			}
+			if n.node {
+				vnodedup(n.node);
+			}
+			n.next = v.next;
+			v.next = n;
+			v.end = start;
+		} else if v.start < start {
+			v.end = start;
+		} else {
+			v.offset = v.offset + (end - v.start);
+			v.filesz = v.filesz - (end - v.start);
+			if v.filesz < 0 {
+				v.filesz = 0;
+			}
+			v.start = end;
+		}
+
+		link = &v.next;
 	}
 
-	return 0:*byte;
+	unmap_pages(global.curtask.pt, start, end);
 }
 
-vload(f: *vfile, offset: int, vaddr: int, filesz: int, memsz: int): int {
-	var t: *task;
-	var i: int;
-	var o: int;
-	var sz: int;
-	var m: *byte;
+// Find len bytes of the user half that no range covers
+vma_hole(len: int): int {
+	var global: *global;
+	var v: *vma;
+	var addr: int;
 
-	if filesz != 0 && (offset & 4095) != (vaddr & 4095) {
+	global = g();
+
+	// Above the program and its stack
+	addr = 1 << 32;
+	loop {
+		if addr + len > (1 << 47) {
+			return 0;
+		}
+
+		v = global.curtask.vma;
+		loop {
+			if !v {
+				return addr;
+			}
+			if v.start < addr + len && v.end > addr {
+				break;
+			}
+			v = v.next;
+		}
+
+		addr = v.end;
+	}
+}
+
+// Anonymous mmap. The range is only reserved here; vfault gives it zeroed
+// pages as they are touched.
+vmmap(addr: int, len: int, prot: int, flags: int): int {
+	var vflags: int;
+
+	if !(flags & MAP_ANONYMOUS) {
 		return -1;
 	}
 
-	if filesz > memsz {
+	if len <= 0 || len > (1 << 47) {
 		return -1;
 	}
 
-	if offset < 0 || vaddr < 0 {
+	len = (len + 4095) & -4096;
+
+	if flags & MAP_FIXED {
+		if (addr & 4095) != 0 || addr < 4096 || addr > (1 << 47) - len {
+			return -1;
+		}
+		vma_unmap(addr, addr + len);
+	} else {
+		addr = vma_hole(len);
+		if !addr {
+			return -1;
+		}
+	}
+
+	vflags = 0;
+	if prot & PROT_WRITE {
+		vflags = VMA_WRITE;
+	}
+
+	if vma_add(addr, len, vflags, 0:*vnode, 0, 0) != 0 {
 		return -1;
 	}
 
-	if vaddr < 4096 {
+	return addr;
+}
+
+vmunmap(addr: int, len: int): int {
+	if (addr & 4095) != 0 || addr < 0 || len <= 0 || addr > (1 << 47) - len {
 		return -1;
 	}
 
-	if filesz > 0 {
-		if vseek(f, offset, 0) != offset {
-			return -1;
+	vma_unmap(addr, addr + ((len + 4095) & -4096));
+
+	return 0;
+}
+
+vma_dup(v: *vma): *vma {
+	var head: *vma;
+	var link: **vma;
+	var n: *vma;
+
+	head = 0:*vma;
+	link = &head;
+	loop {
+		if !v {
+			break;
+		}
+
+		n = kmalloc(sizeof(*n)):*vma;
+		n.next = 0:*vma;
+		n.start = v.start;
+		n.end = v.end;
+		n.flags = v.flags;
+		n.node = v.node;
+		n.offset = v.offset;
+		n.filesz = v.filesz;
+		if n.node {
+			vnodedup(n.node);
 		}
+
+		*link = n;
+		link = &n.next;
+		v = v.next;
 	}
 
+	return head;
+}
+
+// Copy the user half of the page table at pt for a child process. Private
+// pages are not copied but shared read-only by both tables, and vfault
+// gives a process its own copy when it writes. Only the tables are
+// allocated, but every present entry is still visited and each private
+// page gets another reference, so fork still grows with the resident size.
+// It just costs far less per page than copying.
+forkpt_level(pt: int, level: int, n: int): int {
+	var p: *int;
+	var q: *int;
+	var c: int;
+	var i: int;
+
+	p = ptov(pt):*int;
+
+	c = alloc_page();
+	q = ptov(c):*int;
+	bzero(q:*byte, 4096);
+
 	i = 0;
 	loop {
-		if i >= memsz {
+		if i == n {
 			break;
 		}
-		o = (vaddr + i) & 4065;
-		sz = 4096 - o;
-		m = map_user((vaddr + i) & -4096);
-		if !m {
-			return -1;
-		}
-		if i < filesz {
-			if sz > filesz - i {
-				if vread(f, &m[o], filesz - i) != filesz - i {
-					return -1;
-				}
+
+		if p[i] & PTE_P {
+			if level > 0 {
+				q[i] = forkpt_level(p[i] & -4096, level - 1, 512) | (p[i] & 4095);
 			} else {
-				if vread(f, &m[o], sz) != sz {
-					return -1;
+				if !(p[i] & PTE_FILE) {
+					p[i] = p[i] & ~PTE_W;
+					page_get(p[i] & -4096);
 				}
+				q[i] = p[i];
+			}
+		}
+
+		i = i + 1;
+	}
+
+	return c;
+}
+
+forkpt(pt: int): int {
+	var c: int;
+
+	c = forkpt_level(pt, 3, 256);
+	share_kernel(c);
+
+	return c;
+}
+
+// Resolve a page fault at addr in the current task. Pages of the file that
+// are read map the page cache itself, so every process running a program
+// shares its text. A write to such a page in a writable range gets a
+// private copy. CR0.WP is set at boot, so writes by the kernel to user
+// memory come through here as well. Returns 0 if the access can continue.
+vfault(addr: int, err: int): int {
+	var global: *global;
+	var v: *vma;
+	var pte: *int;
+	var ref: *int;
+	var page: *byte;
+	var k: int;
+	var n: int;
+
+	global = g();
+
+	addr = addr & -4096;
+
+	v = global.curtask.vma;
+	loop {
+		if !v {
+			return -1;
+		}
+		if addr >= v.start && addr < v.end {
+			break;
+		}
+		v = v.next;
+	}
+
+	if (err & PTE_W) && !(v.flags & VMA_WRITE) {
+		return -1;
+	}
+
+	pte = user_pte(global.curtask.pt, addr, 1);
+
+	if *pte & PTE_P {
+		if !(err & PTE_W) || (*pte & PTE_W) {
+			// Stale TLB entry
+			invlpg(addr);
+			return 0;
+		}
+
+		// Write to a page shared with the page cache or, after fork, with
+		// other processes. The last process left with it keeps it.
+		if !(*pte & PTE_FILE) {
+			ref = page_ref(*pte & -4096);
+			if *ref == 0 {
+				*pte = *pte | PTE_W;
+				invlpg(addr);
+				return 0;
 			}
 		}
-		i = i + sz;
+
+		page = alloc();
+		memcpy(page, ptov(*pte & -4096), 4096);
+		if !(*pte & PTE_FILE) {
+			page_put(*pte & -4096);
+		}
+		*pte = vtop(page) | PTE_P | PTE_W | PTE_U;
+		invlpg(addr);
+		return 0;
+	}
+
+	k = addr - v.start;
+
+	if k + 4096 <= v.filesz && !(err & PTE_W) {
+		*pte = vtop(vpage_get(v.node, (v.offset + k) >> 12)) | PTE_P | PTE_U | PTE_FILE;
+		return 0;
+	}
+
+	// The page is private: a write, the partial page at the end of the
+	// file data, or zeros past it
+	page = alloc();
+
+	n = 0;
+	if k < v.filesz {
+		n = v.filesz - k;
+		if n > 4096 {
+			n = 4096;
+		}
+		memcpy(page, vpage_get(v.node, (v.offset + k) >> 12), n);
+	}
+	bzero(&page[n], 4096 - n);
+
+	if v.flags & VMA_WRITE {
+		*pte = vtop(page) | PTE_P | PTE_W | PTE_U;
+	} else {
+		*pte = vtop(page) | PTE_P | PTE_U;
 	}
 
 	return 0;
 }
 
+// Map a loadable segment. Nothing is read here; vfault brings in each page
+// when it is first touched.
+vload(f: *vfile, offset: int, vaddr: int, filesz: int, memsz: int, flags: int): int {
+	var node: *vnode;
+
+	if filesz != 0 && (offset & 4095) != (vaddr & 4095) {
+		return -1;
+	}
+
+	if filesz > memsz {
+		return -1;
+	}
+
+	if offset < 0 || vaddr < 0 || filesz < 0 {
+		return -1;
+	}
+
+	if vaddr < 4096 {
+		return -1;
+	}
+
+	if filesz > f.node.size - offset {
+		return -1;
+	}
+
+	if filesz == 0 {
+		node = 0:*vnode;
+	} else {
+		node = f.node;
+	}
+
+	// ELF PF_W
+	if flags & 2 {
+		return vma_add(vaddr, memsz, VMA_WRITE, node, offset, filesz);
+	}
+
+	return vma_add(vaddr, memsz, 0, node, offset, filesz);
+}
+
 map_stack(argc: int, argv: **byte, envc: int, envv: **byte):int {
 	var m: *int;
 	var i: int;
@@ -4461,16 +6103,9 @@ map_stack(argc: int, argv: **byte, envc: int, envv: **byte):int {
 		n = n + len + 1;
 	}
 
-	// Allocate a user stack
-	i = 1;
-	loop {
-		if i == 16 {
-			break;
-		}
-		if !map_user(0x7fffe000 - 4096 * i) {
-			return 0;
-		}
-		i = i + 1;
+	// The rest of the stack is filled in as it grows
+	if vma_add(sp + 4096 - USER_STACK_SIZE, USER_STACK_SIZE, VMA_WRITE, 0:*vnode, 0, 0) != 0 {
+		return 0;
 	}
 
 	return sp;
@@ -4494,17 +6129,20 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 	var p_vaddr: int;
 	var p_filesz: int;
 	var p_memsz: int;
+	var p_flags: int;
 	var pt: int;
 	var global: *global;
 	var t: *task;
 	var stack: int;
+	var vma: *vma;
 
 	global = g();
 	t = global.curtask;
 
 	pt = t.pt;
-	t.pt = alloc_page();
-	bzero(ptov(t.pt), 4096);
+	t.pt = newpt();
+	vma = t.vma;
+	t.vma = 0:*vma;
 
 	head = alloc();
 	args = alloc():**byte;
@@ -4573,7 +6211,7 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 
 			args[0] = strndup(&head[2], i - 2);
 			if nargs > 1 {
-				free(args[1]);
+				kfree(args[1]);
 			} else {
 				nargs = 2;
 			}
@@ -4690,6 +6328,10 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 			| (head[i * 56 + 1]:int << 8)
 			| (head[i * 56 + 2]:int << 16)
 			| (head[i * 56 + 3]:int << 24);
+		p_flags = head[i * 56 + 4]:int
+			| (head[i * 56 + 5]:int << 8)
+			| (head[i * 56 + 6]:int << 16)
+			| (head[i * 56 + 7]:int << 24);
 		p_offset = head[i * 56 + 8]:int
 			| (head[i * 56 + 9]:int << 8)
 			| (head[i * 56 + 10]:int << 16)
@@ -4724,7 +6366,7 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 			| (head[i * 56 + 47]:int << 56);
 
 		if p_type == 1 {
-			if vload(f, p_offset, p_vaddr, p_filesz, p_memsz) != 0 {
+			if vload(f, p_offset, p_vaddr, p_filesz, p_memsz, p_flags) != 0 {
 				goto fail;
 			}
 		}
@@ -4745,7 +6387,7 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 			break;
 		}
 		if args[i] {
-			free(args[i]);
+			kfree(args[i]);
 		}
 		i = i + 1;
 	}
@@ -4755,13 +6397,14 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 			break;
 		}
 		if envs[i] {
-			free(envs[i]);
+			kfree(envs[i]);
 		}
 		i = i + 1;
 	}
 	free(head);
 	free(args:*byte);
 	free(envs:*byte);
+	vma_free(vma);
 	freept(pt);
 	userswitch(entry, stack);
 	kdie("unreachable");
@@ -4776,7 +6419,7 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 			break;
 		}
 		if args[i] {
-			free(args[i]);
+			kfree(args[i]);
 		}
 		i = i + 1;
 	}
@@ -4786,13 +6429,15 @@ vexec(prog: *byte, argv: **byte, envp: **byte): int {
 			break;
 		}
 		if envs[i] {
-			free(envs[i]);
+			kfree(envs[i]);
 		}
 		i = i + 1;
 	}
 	free(head);
 	free(args:*byte);
 	free(envs:*byte);
+	vma_free(t.vma);
+	t.vma = vma;
 	freept(t.pt);
 	t.pt = pt;
 	return -1;
@@ -4827,6 +6472,8 @@ _kstart(mb: int) {
 	var mmap_len: int;
 	var mmap_count: int;
 	var fr: *free_range;
+	var kend: int;
+	var low: int;
 
 	bzero((&task):*byte, sizeof(task));
 	task.next = &task;
@@ -4840,11 +6487,23 @@ _kstart(mb: int) {
 	global.ip_gw = (192 << 24) + (168 << 16) + (1 << 8) + 1;
 	global.ip_mask = 20;
 	global.curtask = &task;
+	global.idle = &task;
 	wrmsr((0xc000 << 16) + 0x0101, global.ptr:int);
 
 	global.mmio = -(1 << 31);
 
-	brk = ptov(1024 * 1024 * 3):int;
+	// The image ends at load_end_addr in its multiboot header. The
+	// initramfs inside it is used in place, and the boot code put the
+	// page tables, gdt and stack it is still running on in the 32K after
+	// it (see emit_kstart), so early allocations go after those, and free
+	// memory starts past them.
+	kend = ((_r32(ptov(0x100000 + 140)) + 4095) & -4096) + 0x8000;
+	low = kend + 1024 * 1024;
+	if low < 0x400000 {
+		low = 0x400000;
+	}
+
+	brk = ptov(kend):int;
 
 	vinit(&global.vga, ptov(0xB8000), brk:*byte);
 	brk = brk + 4096;
@@ -4853,7 +6512,7 @@ _kstart(mb: int) {
 	kputs("Starting up\n");
 
 	global.fr = 0:*free_range;
-	global.fp = 0:*free_page;
+	global.buddy = 0:*buddy;
 	global.kpt = rdcr3();
 
 	mbinfo = ptov(mb);
@@ -4888,8 +6547,8 @@ _kstart(mb: int) {
 		mmap_start = (mmap_start + 4095) & -4096;
 		mmap_end = mmap_end & -4096;
 
-		if mmap_start < 0x400000 {
-			mmap_start = 0x400000;
+		if mmap_start < low {
+			mmap_start = low;
 		}
 
 		if mmap_start < mmap_end && _r32((&mmap[i * 3 + 2]):*byte) == 1 {
@@ -4907,6 +6566,10 @@ _kstart(mb: int) {
 	// Directly map all memory to just above the architectural hole
 	direct_map(&brk);
 
+	setup_buddy(&brk);
+	setup_kmalloc();
+	setup_pcid();
+
 	// Zero tss and add interrupt stacks
 	tss = brk: *int;
 	tss_size = 104;
@@ -5043,12 +6706,11 @@ _kstart(mb: int) {
 
 	spawn(task_init, "init", 0:*void);
 
-	// Wait for interrupts
+	// The boot task stays on as the idle task. It runs when every other
+	// task is asleep, and halts until an interrupt wakes one.
 	kputs("zzz\n");
 	loop {
-		if global.curtask.next == global.curtask {
-			hlt();
-		}
 		yield();
+		hlt();
 	}
 }
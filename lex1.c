@@ -36,12 +36,25 @@ enum {
 	T_RSQ,
 	T_DIV,
 	T_MOD,
+	T_IF,
+	T_ELSE,
+	T_LOOP,
+	T_BREAK,
+	T_CONTINUE,
+	T_RETURN,
+	T_VAR,
+	T_SIZEOF,
+	T_GOTO,
+	T_ENUM,
+	T_STRUCT,
+	T_FUNC,
 }
 
 open_source(c: *compiler, filename: *byte) {
 	var fd: int;
 
 	c.filename = filename;
+	c.fileno = add_file(c, filename);
 	c.nc = 0;
 	c.lineno = 1;
 	c.colno = 1;
@@ -259,6 +272,41 @@ feed_ident(c: *compiler) {
 		}
 		tappend(c);
 	}
+
+	c.tt = keyword(c.token);
+	if (c.tt != T_IDENT) {
+		c.tlen = 0;
+		c.token[0] = 0:byte;
+	}
+}
+
+keyword(s: *byte): int {
+	if (!strcmp(s, "if")) {
+		return T_IF;
+	} else if (!strcmp(s, "else")) {
+		return T_ELSE;
+	} else if (!strcmp(s, "loop")) {
+		return T_LOOP;
+	} else if (!strcmp(s, "break")) {
+		return T_BREAK;
+	} else if (!strcmp(s, "continue")) {
+		return T_CONTINUE;
+	} else if (!strcmp(s, "return")) {
+		return T_RETURN;
+	} else if (!strcmp(s, "var")) {
+		return T_VAR;
+	} else if (!strcmp(s, "sizeof")) {
+		return T_SIZEOF;
+	} else if (!strcmp(s, "goto")) {
+		return T_GOTO;
+	} else if (!strcmp(s, "enum")) {
+		return T_ENUM;
+	} else if (!strcmp(s, "struct")) {
+		return T_STRUCT;
+	} else if (!strcmp(s, "func")) {
+		return T_FUNC;
+	}
+	return T_IDENT;
 }
 
 hexdig(c: *compiler): int {
@@ -267,7 +315,7 @@ hexdig(c: *compiler): int {
 	}
 
 	if (c.nc >= 'A' && c.nc <= 'F') {
-		return (c.nc - 'F') + 10;
+		return (c.nc - 'A') + 10;
 	}
 
 	if (c.nc >= 'a' && c.nc <= 'f') {
@@ -291,10 +339,10 @@ feed_escape(c: *compiler) {
 	} else if (c.nc == 'n') {
 		c.nc = '\n';
 	} else if (c.nc == 'x') {
-		c.nc = fgetc(c.in);
+		feedc(c);
 		hex = hexdig(c) * 16;
 
-		c.nc = fgetc(c.in);
+		feedc(c);
 		hex = hex + hexdig(c);
 
 		c.nc = hex;
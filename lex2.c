@@ -0,0 +1,200 @@
+// Front end over the scanner that genlex builds from cc3.l into lex3.c. Each
+// source file is read into memory once. lexstep finds the longest token at
+// the current offset, keywords included, so feed only has to skip blanks
+// and decode the text of literals.
+
+struct lex_state {
+	buf: *byte;
+	len: int;
+	pos: int;
+	tag: int;
+	end: int;
+}
+
+lexfeedc(l: *lex_state): int {
+	var ch: int;
+
+	if (l.pos >= l.len) {
+		return -1;
+	}
+
+	ch = l.buf[l.pos]:int;
+	l.pos = l.pos + 1;
+
+	return ch;
+}
+
+lexmark(l: *lex_state, tag: int) {
+	l.tag = tag;
+	l.end = l.pos;
+}
+
+open_source(c: *compiler, filename: *byte) {
+	var fd: int;
+
+	c.filename = filename;
+	c.fileno = add_file(c, filename);
+	c.lineno = 1;
+	c.colno = 1;
+	c.tlen = 0;
+	c.tt = 0;
+
+	fd = open(filename, 0, 0);
+	if (fd < 0) {
+		cdie(c, "failed to open file");
+	}
+
+	c.src = mapfile(fd, &c.srclen);
+	c.srcmapped = 1;
+	if (!c.src) {
+		c.src = readall(fd, &c.srclen, c.a);
+		c.srcmapped = 0;
+	}
+	close(fd);
+
+	c.pos = 0;
+
+	feed(c);
+}
+
+// Identifiers and strings are interned, so nothing refers to the source
+// once it has been parsed.
+close_source(c: *compiler) {
+	if (c.src) {
+		if (c.srcmapped) {
+			unmapfile(c.src, c.srclen);
+		} else {
+			free(c.a, c.src);
+		}
+	}
+	c.src = 0:*byte;
+	c.srclen = 0;
+}
+
+feed(c: *compiler) {
+	var l: lex_state;
+	var start: int;
+	var ch: int;
+
+	c.token = c.tbuf;
+	c.tlen = 0;
+	c.token[0] = 0:byte;
+
+	l.buf = c.src;
+	l.len = c.srclen;
+
+	loop {
+		// Blanks are skipped here rather than by the scanner, as the line
+		// count has to look at each of them anyway.
+		loop {
+			if (c.pos == c.srclen) {
+				// Reached the end of input
+				c.tt = T_EOF;
+				return;
+			}
+
+			ch = c.src[c.pos]:int;
+			if (ch == '\n') {
+				c.lineno = c.lineno + 1;
+				c.colno = 1;
+			} else if (ch == ' ' || ch == '\t' || ch == '\r') {
+				c.colno = c.colno + 1;
+			} else {
+				break;
+			}
+
+			c.pos = c.pos + 1;
+		}
+
+		start = c.pos;
+		l.pos = start;
+		l.end = start;
+		lexstep(&l);
+
+		if (l.end == start) {
+			cdie(c, "invalid char");
+		}
+
+		c.pos = l.end;
+		c.colno = c.colno + l.end - start;
+
+		if (l.tag != T_COMMENT) {
+			break;
+		}
+	}
+
+	c.tt = l.tag;
+
+	// Names and numbers are left in the source instead of being copied
+	if (c.tt == T_IDENT || c.tt == T_NUM) {
+		c.token = &c.src[start];
+		c.tlen = c.pos - start;
+	} else if (c.tt == T_HEX) {
+		c.token = &c.src[start + 2];
+		c.tlen = c.pos - start - 2;
+		if (c.tlen == 0) {
+			cdie(c, "expected hex");
+		}
+	} else if (c.tt == T_STR || c.tt == T_CHAR) {
+		unescape(c, start + 1, c.pos - 1);
+	}
+}
+
+hexval(ch: int): int {
+	if (ch >= '0' && ch <= '9') {
+		return ch - '0';
+	}
+
+	if (ch >= 'A' && ch <= 'F') {
+		return (ch - 'A') + 10;
+	}
+
+	return (ch - 'a') + 10;
+}
+
+// Decode the body of a string or character literal. The scanner has
+// already checked its shape, so only the escaped character is left to
+// check.
+unescape(c: *compiler, i: int, end: int) {
+	var ch: int;
+
+	loop {
+		if (i == end) {
+			break;
+		}
+
+		if (c.tlen + 1 >= c.tmax) {
+			cdie(c, "string too long");
+		}
+
+		ch = c.src[i]:int;
+		i = i + 1;
+
+		if (ch == 0) {
+			cdie(c, "invalid char in string");
+		}
+
+		if (ch == '\\') {
+			ch = c.src[i]:int;
+			i = i + 1;
+
+			if (ch == 't') {
+				ch = '\t';
+			} else if (ch == 'r') {
+				ch = '\r';
+			} else if (ch == 'n') {
+				ch = '\n';
+			} else if (ch == 'x') {
+				ch = hexval(c.src[i]:int) * 16 + hexval(c.src[i + 1]:int);
+				i = i + 2;
+			} else if (ch != '\\' && ch != '\'' && ch != '"') {
+				cdie(c, "invalid escape");
+			}
+		}
+
+		c.token[c.tlen] = ch:byte;
+		c.tlen = c.tlen + 1;
+	}
+
+	c.token[c.tlen] = 0:byte;
+}
@@ -0,0 +1,174 @@
+// lexbench measures the throughput of a scanner made by genlex. build.sh
+// builds it through build.mk with the lex3.c that cc2 uses; the table
+// driven scanner is built by hand:
+//
+//	./genlex -t < cc3.l > lex3t.c
+//	./cc2 ${LIBS} lexbench.c lex3t.c -o lexbench-t
+//	./lexbench ${LIBS} ${CC}
+//
+// The files are read into memory once and then scanned -n times (10 by
+// default).
+//
+// To compare the compiler's front ends, including decoding of literals, scan
+// the same inputs with -tokens. bootstrap.sh builds cc1 with the hand-written
+// scanner in lex1.c, and build.sh builds cc2 with lex2.c and lex3.c:
+//
+//	./cc1 -tokens ${LIBS} ${CC}
+//	./cc2 -tokens ${LIBS} ${CC}
+
+struct lex_state {
+	buf: *byte;
+	len: int;
+	pos: int;
+	tag: int;
+	end: int;
+}
+
+lexfeedc(l: *lex_state): int {
+	var ch: int;
+
+	if (l.pos >= l.len) {
+		return -1;
+	}
+
+	ch = l.buf[l.pos]:int;
+	l.pos = l.pos + 1;
+
+	return ch;
+}
+
+lexmark(l: *lex_state, tag: int): void {
+	l.tag = tag;
+	l.end = l.pos;
+}
+
+// Scan the whole buffer and return the number of tokens
+lexall(l: *lex_state): int {
+	var start: int;
+	var n: int;
+
+	n = 0;
+	start = 0;
+	loop {
+		if (start >= l.len) {
+			return n;
+		}
+
+		l.pos = start;
+		l.end = start;
+		lexstep(l);
+
+		// Skip a byte that does not start any token
+		if (l.end == start) {
+			l.end = start + 1;
+		}
+
+		start = l.end;
+		n = n + 1;
+	}
+}
+
+nanotime(): int {
+	var ts: timespec;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		die("clock_gettime failed");
+	}
+
+	return ts.sec * 1000000000 + ts.nsec;
+}
+
+main(argc: int, argv: **byte, envp: **byte): void {
+	var a: alloc;
+	var l: lex_state;
+	var buf: *byte;
+	var cap: int;
+	var fd: int;
+	var data: *byte;
+	var len: int;
+	var rounds: int;
+	var tokens: int;
+	var start: int;
+	var elapsed: int;
+	var i: int;
+	var j: int;
+
+	setup_alloc(&a);
+
+	rounds = 10;
+	cap = 0;
+	buf = 0:*byte;
+	l.len = 0;
+
+	i = 1;
+	loop {
+		if (i >= argc) {
+			break;
+		}
+
+		if (!strcmp(argv[i], "-n")) {
+			if (i + 1 >= argc) {
+				die("usage: lexbench [-n rounds] file...");
+			}
+			rounds = 0;
+			j = 0;
+			loop {
+				if (!argv[i + 1][j]) {
+					break;
+				}
+				rounds = rounds * 10 + argv[i + 1][j]:int - '0';
+				j = j + 1;
+			}
+			i = i + 2;
+			continue;
+		}
+
+		fd = open(argv[i], O_RDONLY, 0);
+		if (fd < 0) {
+			die("failed to open input");
+		}
+
+		data = readall(fd, &len, &a);
+		close(fd);
+
+		if (l.len + len > cap) {
+			cap = (l.len + len) * 2;
+			buf = realloc(&a, buf, cap);
+		}
+
+		memcpy(&buf[l.len], data, len);
+		l.len = l.len + len;
+		free(&a, data);
+
+		i = i + 1;
+	}
+
+	if (rounds <= 0) {
+		die("usage: lexbench [-n rounds] file...");
+	}
+
+	l.buf = buf;
+
+	tokens = 0;
+	start = nanotime();
+	i = 0;
+	loop {
+		if (i == rounds) {
+			break;
+		}
+		tokens = tokens + lexall(&l);
+		i = i + 1;
+	}
+	elapsed = (nanotime() - start) / 1000;
+
+	if (elapsed <= 0) {
+		elapsed = 1;
+	}
+
+	fdputd(1, tokens);
+	fdputs(1, " tokens in ");
+	fdputd(1, elapsed / 1000);
+	fdputs(1, " ms, ");
+	fdputd(1, tokens * 1000000 / elapsed);
+	fdputs(1, " tokens/s\n");
+}
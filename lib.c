@@ -4,14 +4,44 @@ die(msg: *byte) {
 	exit(1);
 }
 
+// The string and memory functions work a word at a time. A word x holds a
+// zero byte exactly when (x - ONES) & ~x & HIGHS is non-zero, where ONES has
+// 0x01 in every byte and HIGHS has 0x80. Aligned loads never cross a page,
+// so strlen may read past the end of the string within the last word.
 strlen(s: *byte): int {
-	var ret: int;
-	ret = 0;
+	var i: int;
+	var x: int;
+	var ones: int;
+	var highs: int;
+
+	i = 0;
 	loop {
-		if (s[ret] == 0:byte) {
-			return ret;
+		if (((s:int + i) & 7) == 0) {
+			break;
+		}
+		if (s[i] == 0:byte) {
+			return i;
 		}
-		ret = ret + 1;
+		i = i + 1;
+	}
+
+	ones = 0x01010101;
+	ones = ones | (ones << 32);
+	highs = ones << 7;
+
+	loop {
+		x = *((&s[i]):*int);
+		if ((x - ones) & ~x & highs) {
+			break;
+		}
+		i = i + 8;
+	}
+
+	loop {
+		if (s[i] == 0:byte) {
+			return i;
+		}
+		i = i + 1;
 	}
 }
 
@@ -20,6 +50,19 @@ memcmp(a: *byte, b: *byte, n: int): int {
 
 	i = 0;
 
+	// Skip equal words, then find the first differing byte
+	loop {
+		if (n - i < 8) {
+			break;
+		}
+
+		if (*((&a[i]):*int) != *((&b[i]):*int)) {
+			break;
+		}
+
+		i = i + 8;
+	}
+
 	loop {
 		if i == n {
 			return 0;
@@ -39,9 +82,45 @@ memcmp(a: *byte, b: *byte, n: int): int {
 
 strcmp(a: *byte, b: *byte): int {
 	var i: int;
+	var x: int;
+	var ones: int;
+	var highs: int;
 
 	i = 0;
 
+	// Strings at the same offset within a word are compared a word at a
+	// time once aligned, stopping at a difference or the end of a.
+	if (((a:int ^ b:int) & 7) == 0) {
+		loop {
+			if (((a:int + i) & 7) == 0) {
+				break;
+			}
+
+			if (a[i] != b[i] || a[i] == 0:byte) {
+				break;
+			}
+
+			i = i + 1;
+		}
+
+		if (((a:int + i) & 7) == 0) {
+			ones = 0x01010101;
+			ones = ones | (ones << 32);
+			highs = ones << 7;
+
+			loop {
+				x = *((&a[i]):*int);
+				if (x != *((&b[i]):*int)) {
+					break;
+				}
+				if ((x - ones) & ~x & highs) {
+					break;
+				}
+				i = i + 8;
+			}
+		}
+	}
+
 	loop {
 		if (a[i] > b[i]) {
 			return 1;
@@ -82,17 +161,16 @@ fdputc(fd: int, ch: int) {
 	}
 }
 
-fdputs(fd: int, msg: *byte) {
-	var len: int;
+// Write all of buf, one call per chunk the kernel accepts
+fdwrite(fd: int, buf: *byte, len: int) {
 	var ret: int;
 	var off: int;
-	len = strlen(msg);
 	off = 0;
 	loop {
 		if (off == len) {
 			break;
 		}
-		ret = write(fd, msg, len - off);
+		ret = write(fd, &buf[off], len - off);
 		if (ret < 0) {
 			exit(3);
 		}
@@ -100,46 +178,55 @@ fdputs(fd: int, msg: *byte) {
 	}
 }
 
-fdputh(fd: int, n: int) {
-	var c: int;
-	var r: int;
-
-	r = 0;
-	loop {
-		if (n == 0) {
-			break;
-		}
+fdputs(fd: int, msg: *byte) {
+	fdwrite(fd, msg, strlen(msg));
+}
 
-		r = (r << 4) + (n & 15);
-		n = n >> 4;
-	}
+// Numbers are formatted on the stack and written with a single call
+struct _fdnum {
+	d0: int;
+	d1: int;
+	d2: int;
+	d3: int;
+}
 
-	n = r;
+fdputh(fd: int, n: int) {
+	var b: _fdnum;
+	var s: *byte;
+	var i: int;
 
+	s = (&b):*byte;
+	i = sizeof(b);
 	loop {
-		c = n & 15;
-		n = n >> 4;
-
-		if (c < 10) {
-			fdputc(fd, c + '0');
-		} else {
-			fdputc(fd, c + ('a' - 10));
-		}
+		i = i - 1;
+		s[i] = "0123456789abcdef"[n & 15];
+		n = (n >> 4) & ~(15 << 60);
 
 		if (n == 0) {
 			break;
 		}
 	}
+
+	fdwrite(fd, &s[i], sizeof(b) - i);
 }
 
 fdputhn(fd: int, x: int, d: int) {
+	var b: _fdnum;
+	var s: *byte;
+	var i: int;
+
+	s = (&b):*byte;
+	i = 0;
 	loop {
 		if d == 0 {
 			break;
 		}
 		d = d - 4;
-		fdputc(fd, "0123456789abcdef"[(x >> d) & 15]:int);
+		s[i] = "0123456789abcdef"[(x >> d) & 15];
+		i = i + 1;
 	}
+
+	fdwrite(fd, s, i);
 }
 
 fdputh8(fd: int, x: int) {
@@ -159,22 +246,34 @@ fdputh64(fd: int, x: int) {
 }
 
 fdputd(fd: int, n: int) {
-	var a: int;
+	var b: _fdnum;
+	var s: *byte;
+	var i: int;
+	var neg: int;
 
-	if (n < 0) {
-		fdputc(fd, '-');
-		a = -(n % 10);
-		n = n / -10;
-	} else {
-		a = n % 10;
+	s = (&b):*byte;
+	i = sizeof(b);
+	neg = n < 0;
+	loop {
+		i = i - 1;
+		if (n < 0) {
+			s[i] = ('0' - n % 10):byte;
+		} else {
+			s[i] = ('0' + n % 10):byte;
+		}
 		n = n / 10;
+
+		if (n == 0) {
+			break;
+		}
 	}
 
-	if (n != 0) {
-		fdputd(fd, n);
+	if (neg) {
+		i = i - 1;
+		s[i] = '-':byte;
 	}
 
-	fdputc(fd, '0' + a);
+	fdwrite(fd, &s[i], sizeof(b) - i);
 }
 
 xxd_line(line: *byte, offset: int, data: *byte, len: int) {
@@ -314,25 +413,39 @@ fdxxd(fd: int, data: *byte, len: int) {
 }
 
 bzero(s: *byte, size: int) {
-	var i: int;
-	i = 0;
-	loop {
-		if i == size {
-			break;
-		}
-		s[i] = 0:byte;
-		i = i + 1;
-	}
+	memset(s, 0, size);
 }
 
 memset(dest: *byte, c: int, size: int) {
 	var i: int;
+	var x: int;
 
 	if size < 0 {
 		return;
 	}
 
 	i = 0;
+	if size >= 16 {
+		loop {
+			if ((dest:int + i) & 7) == 0 {
+				break;
+			}
+			dest[i] = c:byte;
+			i = i + 1;
+		}
+
+		x = 0x01010101;
+		x = (x | (x << 32)) * (c & 255);
+
+		loop {
+			if size - i < 8 {
+				break;
+			}
+			*((&dest[i]):*int) = x;
+			i = i + 8;
+		}
+	}
+
 	loop {
 		if i == size {
 			break;
@@ -343,7 +456,18 @@ memset(dest: *byte, c: int, size: int) {
 }
 
 memcpy(dest: *byte, src: *byte, size: int) {
+	memmove(dest, src, size);
+}
+
+// Copy size bytes, which may overlap. Words are moved in the direction
+// that reads each source byte before it is overwritten, with the stores
+// aligned.
+memmove(dest: *byte, src: *byte, size: int) {
 	var i: int;
+	var w0: int;
+	var w1: int;
+	var w2: int;
+	var w3: int;
 
 	if size < 0 {
 		return;
@@ -351,6 +475,40 @@ memcpy(dest: *byte, src: *byte, size: int) {
 
 	if src > dest {
 		i = 0;
+
+		if size >= 16 {
+			loop {
+				if ((dest:int + i) & 7) == 0 {
+					break;
+				}
+				dest[i] = src[i];
+				i = i + 1;
+			}
+
+			loop {
+				if size - i < 32 {
+					break;
+				}
+				w0 = *((&src[i]):*int);
+				w1 = *((&src[i + 8]):*int);
+				w2 = *((&src[i + 16]):*int);
+				w3 = *((&src[i + 24]):*int);
+				*((&dest[i]):*int) = w0;
+				*((&dest[i + 8]):*int) = w1;
+				*((&dest[i + 16]):*int) = w2;
+				*((&dest[i + 24]):*int) = w3;
+				i = i + 32;
+			}
+
+			loop {
+				if size - i < 8 {
+					break;
+				}
+				*((&dest[i]):*int) = *((&src[i]):*int);
+				i = i + 8;
+			}
+		}
+
 		loop {
 			if i == size {
 				break;
@@ -360,6 +518,40 @@ memcpy(dest: *byte, src: *byte, size: int) {
 		}
 	} else if src < dest {
 		i = size;
+
+		if size >= 16 {
+			loop {
+				if ((dest:int + i) & 7) == 0 {
+					break;
+				}
+				i = i - 1;
+				dest[i] = src[i];
+			}
+
+			loop {
+				if i < 32 {
+					break;
+				}
+				w0 = *((&src[i - 8]):*int);
+				w1 = *((&src[i - 16]):*int);
+				w2 = *((&src[i - 24]):*int);
+				w3 = *((&src[i - 32]):*int);
+				*((&dest[i - 8]):*int) = w0;
+				*((&dest[i - 16]):*int) = w1;
+				*((&dest[i - 24]):*int) = w2;
+				*((&dest[i - 32]):*int) = w3;
+				i = i - 32;
+			}
+
+			loop {
+				if i < 8 {
+					break;
+				}
+				i = i - 8;
+				*((&dest[i]):*int) = *((&src[i]):*int);
+			}
+		}
+
 		loop {
 			if i == 0 {
 				break;
@@ -451,30 +643,34 @@ assert(x: int, msg: *byte) {
 	}
 }
 
+// Read everything up to the end of the file. A regular file is read at its
+// size in one go, with a spare byte so that the read that finds the end
+// does not grow the buffer. Anything else starts at 4K and doubles.
 readall(fd: int, len: *int, a: *alloc): *byte {
 	var buf: *byte;
-	var tmp: *byte;
 	var cap: int;
-	var newcap: int;
 	var ret: int;
 	var n: int;
+	var st: stat;
 
+	buf = 0:*byte;
 	cap = 0;
 	n = 0;
 
+	if fstat(fd, (&st):*byte) == 0 && (st.uid_mode & S_IFMT) == S_IFREG && st.size > 0 {
+		cap = st.size + 1;
+		buf = alloc(a, cap);
+	}
+
 	loop {
 		if n == cap {
 			if cap == 0 {
-				newcap = 4096;
+				cap = 4096;
 			} else {
-				newcap = cap * 2;
+				cap = cap * 2;
 			}
 
-			tmp = alloc(a, newcap);
-			memcpy(tmp, buf, n);
-			free(a, buf);
-			buf = tmp;
-			cap = newcap;
+			buf = realloc(a, buf, cap);
 		}
 
 		ret = read(fd, &buf[n], cap - n);
@@ -494,3 +690,35 @@ readall(fd: int, len: *int, a: *alloc): *byte {
 
 	return buf;
 }
+
+// Map a regular file read-only instead of copying it. Returns 0 if fd is
+// not a regular file or cannot be mapped, in which case use readall. An
+// empty file gives an empty string. Release the mapping with unmapfile.
+mapfile(fd: int, len: *int): *byte {
+	var st: stat;
+	var ret: int;
+
+	if fstat(fd, (&st):*byte) != 0 || (st.uid_mode & S_IFMT) != S_IFREG {
+		return 0:*byte;
+	}
+
+	if st.size == 0 {
+		*len = 0;
+		return "";
+	}
+
+	ret = mmap(0, st.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if ret < 0 {
+		return 0:*byte;
+	}
+
+	*len = st.size;
+
+	return ret:*byte;
+}
+
+unmapfile(p: *byte, len: int) {
+	if len > 0 {
+		munmap(p:int, len);
+	}
+}
@@ -5,9 +5,12 @@ main(argc: int, argv: **byte, envp: **byte) {
 	var len: int;
 	var a: alloc;
 	var buf: *byte;
+	var out: *file;
 
 	setup_alloc(&a);
 
+	out = fopen(1, &a);
+
 	fd = open(".", O_DIRECTORY, 0);
 	if fd < 0 {
 		exit(1);
@@ -25,17 +28,19 @@ main(argc: int, argv: **byte, envp: **byte) {
 			die("getdirents failed");
 		}
 
+		i = 0;
 		loop {
 			if i + 20 >= n {
 				break;
 			}
 
-			fdputs(1, &buf[i + 19]);
-			fdputc(1, ' ');
+			fputs(out, &buf[i + 19]);
+			fputc(out, ' ');
 
 			i = i + ((&buf[i + 16]):*int[0] & 0xffff);
 		}
 	}
 
-	fdputc(1, '\n');
+	fputc(out, '\n');
+	fflush(out);
 }
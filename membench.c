@@ -0,0 +1,326 @@
+// membench checks the string and memory functions in lib.c against simple
+// byte loops and then reports their throughput in bytes per cycle for
+// sizes from 1 byte to 1 MB. build.sh builds it through build.mk:
+//
+//	./membench
+//
+// Every size moves about 4 MB in total, so small sizes mostly measure the
+// cost of the call. The kernel carries its own copies of these functions,
+// which match the ones in lib.c.
+
+enum {
+	MB_MEMCPY = 0,
+	MB_MEMMOVE = 1,
+	MB_MEMSET = 2,
+	MB_MEMCMP = 3,
+	MB_STRLEN = 4,
+	MB_STRCMP = 5,
+	MB_NOPS = 6,
+
+	MB_MAX = 1048576,
+	MB_TOTAL = 4194304,
+}
+
+rdtsc(): int;
+
+mbname(op: int): *byte {
+	if op == MB_MEMCPY {
+		return "memcpy ";
+	} else if op == MB_MEMMOVE {
+		return "memmove";
+	} else if op == MB_MEMSET {
+		return "memset ";
+	} else if op == MB_MEMCMP {
+		return "memcmp ";
+	} else if op == MB_STRLEN {
+		return "strlen ";
+	}
+	return "strcmp ";
+}
+
+mbfill(p: *byte, n: int, seed: int) {
+	var i: int;
+	i = 0;
+	loop {
+		if i == n {
+			break;
+		}
+		p[i] = ((i * 7 + seed) % 251 + 1):byte;
+		i = i + 1;
+	}
+}
+
+mbsame(a: *byte, b: *byte, n: int): int {
+	var i: int;
+	i = 0;
+	loop {
+		if i == n {
+			return 1;
+		}
+		if a[i] != b[i] {
+			return 0;
+		}
+		i = i + 1;
+	}
+}
+
+mbfail(op: int, n: int, off: int) {
+	fdputs(2, "membench: ");
+	fdputs(2, mbname(op));
+	fdputs(2, " failed at size ");
+	fdputd(2, n);
+	fdputs(2, " offset ");
+	fdputd(2, off);
+	fdputs(2, "\n");
+	exit(1);
+}
+
+// Compare each function with the obvious loop for every small size and
+// every alignment of the source and destination.
+mbcheck(a: *byte, b: *byte, c: *byte) {
+	var n: int;
+	var off: int;
+	var i: int;
+
+	n = 0;
+	loop {
+		if n == 80 {
+			break;
+		}
+
+		off = 0;
+		loop {
+			if off == 64 {
+				break;
+			}
+
+			// memcpy with source and destination offsets off & 7 and off >> 3
+			mbfill(a, 256, n);
+			mbfill(b, 256, n + 1);
+			mbfill(c, 256, n + 1);
+			memcpy(&b[off >> 3], &a[off & 7], n);
+			i = 0;
+			loop {
+				if i == n {
+					break;
+				}
+				c[(off >> 3) + i] = a[(off & 7) + i];
+				i = i + 1;
+			}
+			if !mbsame(b, c, 256) {
+				mbfail(MB_MEMCPY, n, off);
+			}
+
+			// memmove in both directions within one buffer
+			mbfill(a, 256, n);
+			mbfill(c, 256, n);
+			memmove(&a[off >> 3], &a[off & 7], n);
+			if (off >> 3) < (off & 7) {
+				i = 0;
+				loop {
+					if i == n {
+						break;
+					}
+					c[(off >> 3) + i] = c[(off & 7) + i];
+					i = i + 1;
+				}
+			} else {
+				i = n;
+				loop {
+					if i == 0 {
+						break;
+					}
+					i = i - 1;
+					c[(off >> 3) + i] = c[(off & 7) + i];
+				}
+			}
+			if !mbsame(a, c, 256) {
+				mbfail(MB_MEMMOVE, n, off);
+			}
+
+			// memset
+			mbfill(a, 256, n);
+			mbfill(c, 256, n);
+			memset(&a[off], 0xa5, n);
+			i = 0;
+			loop {
+				if i == n {
+					break;
+				}
+				c[off + i] = 0xa5:byte;
+				i = i + 1;
+			}
+			if !mbsame(a, c, 256) {
+				mbfail(MB_MEMSET, n, off);
+			}
+
+			// memcmp and strcmp, equal and then differing in the last byte
+			mbfill(a, 256, 3);
+			i = 0;
+			loop {
+				if i == n {
+					break;
+				}
+				b[(off >> 3) + i] = a[(off & 7) + i];
+				i = i + 1;
+			}
+			a[(off & 7) + n] = 0:byte;
+			b[(off >> 3) + n] = 0:byte;
+			if memcmp(&a[off & 7], &b[off >> 3], n) != 0 {
+				mbfail(MB_MEMCMP, n, off);
+			}
+			if strcmp(&a[off & 7], &b[off >> 3]) != 0 {
+				mbfail(MB_STRCMP, n, off);
+			}
+			if n > 0 {
+				a[(off & 7) + n - 1] = 0xff:byte;
+				if memcmp(&a[off & 7], &b[off >> 3], n) != 1 {
+					mbfail(MB_MEMCMP, n, off);
+				}
+				if strcmp(&a[off & 7], &b[off >> 3]) != 1 {
+					mbfail(MB_STRCMP, n, off);
+				}
+				if strcmp(&b[off >> 3], &a[off & 7]) != -1 {
+					mbfail(MB_STRCMP, n, off);
+				}
+			}
+
+			// strlen
+			mbfill(a, 256, n);
+			a[off + n] = 0:byte;
+			if strlen(&a[off]) != n {
+				mbfail(MB_STRLEN, n, off);
+			}
+
+			off = off + 1;
+		}
+
+		n = n + 1;
+	}
+}
+
+// Cycles taken to run op on n bytes iters times
+mbrun(op: int, a: *byte, b: *byte, n: int, iters: int): int {
+	var start: int;
+	var i: int;
+
+	start = rdtsc();
+
+	i = 0;
+	if op == MB_MEMCPY {
+		loop {
+			if i == iters {
+				break;
+			}
+			memcpy(b, a, n);
+			i = i + 1;
+		}
+	} else if op == MB_MEMMOVE {
+		loop {
+			if i == iters {
+				break;
+			}
+			memmove(&a[1], a, n);
+			i = i + 1;
+		}
+	} else if op == MB_MEMSET {
+		loop {
+			if i == iters {
+				break;
+			}
+			memset(b, 0, n);
+			i = i + 1;
+		}
+	} else if op == MB_MEMCMP {
+		loop {
+			if i == iters {
+				break;
+			}
+			memcmp(a, b, n);
+			i = i + 1;
+		}
+	} else if op == MB_STRLEN {
+		loop {
+			if i == iters {
+				break;
+			}
+			strlen(a);
+			i = i + 1;
+		}
+	} else {
+		loop {
+			if i == iters {
+				break;
+			}
+			strcmp(a, b);
+			i = i + 1;
+		}
+	}
+
+	return rdtsc() - start;
+}
+
+main(argc: int, argv: **byte, envp: **byte) {
+	var a: alloc;
+	var x: *byte;
+	var y: *byte;
+	var z: *byte;
+	var op: int;
+	var n: int;
+	var iters: int;
+	var cycles: int;
+	var r: int;
+
+	setup_alloc(&a);
+
+	x = alloc(&a, MB_MAX + 64);
+	y = alloc(&a, MB_MAX + 64);
+	z = alloc(&a, MB_MAX + 64);
+
+	mbcheck(x, y, z);
+
+	op = 0;
+	loop {
+		if op == MB_NOPS {
+			break;
+		}
+
+		n = 1;
+		loop {
+			if n > MB_MAX {
+				break;
+			}
+
+			// Equal strings of n bytes, so the comparisons run to the end
+			memset(x, 'x', n);
+			memset(y, 'x', n);
+			x[n] = 0:byte;
+			y[n] = 0:byte;
+
+			iters = MB_TOTAL / n;
+
+			// Warm up the caches, then time
+			mbrun(op, x, y, n, 1);
+			cycles = mbrun(op, x, y, n, iters);
+			if cycles <= 0 {
+				cycles = 1;
+			}
+
+			r = n * iters * 100 / cycles;
+
+			fdputs(1, mbname(op));
+			fdputs(1, " ");
+			fdputd(1, n);
+			fdputs(1, "\t");
+			fdputd(1, r / 100);
+			fdputs(1, ".");
+			fdputd(1, (r / 10) % 10);
+			fdputd(1, r % 10);
+			fdputs(1, " bytes/cycle\n");
+
+			n = n * 2;
+		}
+
+		op = op + 1;
+	}
+}
@@ -0,0 +1,563 @@
+// mk builds the targets listed in a file such as build.mk, running up to
+// one compiler per core at a time. Each line is one of
+//
+//	# comment
+//	NAME = word...
+//	target: word...
+//
+// A target is built with "$CC word... -o target", where a word of the form
+// $NAME expands to the words of a variable. Targets newer than all of their
+// sources and the compiler are skipped.
+
+struct mkword {
+	next: *mkword;
+	s: *byte;
+}
+
+struct mkvar {
+	next: *mkvar;
+	name: *byte;
+	words: *mkword;
+}
+
+struct mktarget {
+	next: *mktarget;
+	name: *byte;
+	words: *mkword;
+	pid: int;
+}
+
+struct mk {
+	a: *alloc;
+	filename: *byte;
+	lineno: int;
+	vars: *mkvar;
+	targets: *mktarget;
+	last: *mktarget;
+	envp: **byte;
+}
+
+mkdie(m: *mk, msg: *byte) {
+	fdputs(2, m.filename);
+	fdputs(2, ":");
+	fdputd(2, m.lineno);
+	fdputs(2, ": ");
+	fdputs(2, msg);
+	fdputs(2, "\n");
+	exit(1);
+}
+
+mkstrndup(m: *mk, s: *byte, n: int): *byte {
+	var r: *byte;
+	r = alloc(m.a, n + 1);
+	memcpy(r, s, n);
+	r[n] = 0:byte;
+	return r;
+}
+
+mkfind(m: *mk, name: *byte): *mkvar {
+	var v: *mkvar;
+	v = m.vars;
+	loop {
+		if !v {
+			return 0:*mkvar;
+		}
+		if !strcmp(v.name, name) {
+			return v;
+		}
+		v = v.next;
+	}
+}
+
+// Split s[0:n] into words, expanding variable references
+mksplit(m: *mk, s: *byte, n: int): *mkword {
+	var head: *mkword;
+	var tail: *mkword;
+	var w: *mkword;
+	var e: *mkword;
+	var v: *mkvar;
+	var name: *byte;
+	var i: int;
+	var j: int;
+
+	head = 0:*mkword;
+	tail = 0:*mkword;
+
+	i = 0;
+	loop {
+		loop {
+			if i == n || (s[i] != ' ':byte && s[i] != '\t':byte) {
+				break;
+			}
+			i = i + 1;
+		}
+
+		if i == n {
+			break;
+		}
+
+		j = i;
+		loop {
+			if j == n || s[j] == ' ':byte || s[j] == '\t':byte {
+				break;
+			}
+			j = j + 1;
+		}
+
+		if s[i] == '$':byte {
+			if j - i > 3 && s[i + 1] == '{':byte && s[j - 1] == '}':byte {
+				name = mkstrndup(m, &s[i + 2], j - i - 3);
+			} else {
+				name = mkstrndup(m, &s[i + 1], j - i - 1);
+			}
+
+			v = mkfind(m, name);
+			if !v {
+				mkdie(m, "undefined variable");
+			}
+
+			e = v.words;
+			loop {
+				if !e {
+					break;
+				}
+
+				w = alloc(m.a, sizeof(*w)):*mkword;
+				w.next = 0:*mkword;
+				w.s = e.s;
+				if tail {
+					tail.next = w;
+				} else {
+					head = w;
+				}
+				tail = w;
+
+				e = e.next;
+			}
+		} else {
+			w = alloc(m.a, sizeof(*w)):*mkword;
+			w.next = 0:*mkword;
+			w.s = mkstrndup(m, &s[i], j - i);
+			if tail {
+				tail.next = w;
+			} else {
+				head = w;
+			}
+			tail = w;
+		}
+
+		i = j;
+	}
+
+	return head;
+}
+
+mkline(m: *mk, s: *byte, n: int) {
+	var i: int;
+	var j: int;
+	var v: *mkvar;
+	var t: *mktarget;
+	var w: *mkword;
+
+	i = 0;
+	loop {
+		if i == n || (s[i] != ' ':byte && s[i] != '\t':byte) {
+			break;
+		}
+		i = i + 1;
+	}
+
+	if i == n || s[i] == '#':byte {
+		return;
+	}
+
+	j = i;
+	loop {
+		if j == n {
+			mkdie(m, "expected = or :");
+		}
+
+		if s[j] == '=':byte {
+			v = alloc(m.a, sizeof(*v)):*mkvar;
+			w = mksplit(m, &s[i], j - i);
+			if !w || w.next {
+				mkdie(m, "expected one name before =");
+			}
+			v.name = w.s;
+			v.words = mksplit(m, &s[j + 1], n - j - 1);
+			v.next = m.vars;
+			m.vars = v;
+			return;
+		}
+
+		if s[j] == ':':byte {
+			t = alloc(m.a, sizeof(*t)):*mktarget;
+			t.next = 0:*mktarget;
+			w = mksplit(m, &s[i], j - i);
+			if !w || w.next {
+				mkdie(m, "expected one target before :");
+			}
+			t.name = w.s;
+			t.words = mksplit(m, &s[j + 1], n - j - 1);
+			t.pid = 0;
+			if m.last {
+				m.last.next = t;
+			} else {
+				m.targets = t;
+			}
+			m.last = t;
+			return;
+		}
+
+		j = j + 1;
+	}
+}
+
+mkparse(m: *mk) {
+	var fd: int;
+	var buf: *byte;
+	var len: int;
+	var i: int;
+	var j: int;
+
+	fd = open(m.filename, O_RDONLY, 0);
+	if fd < 0 {
+		mkdie(m, "failed to open");
+	}
+
+	buf = readall(fd, &len, m.a);
+	close(fd);
+
+	i = 0;
+	loop {
+		if i >= len {
+			break;
+		}
+
+		m.lineno = m.lineno + 1;
+
+		j = i;
+		loop {
+			if j == len || buf[j] == '\n':byte {
+				break;
+			}
+			j = j + 1;
+		}
+
+		mkline(m, &buf[i], j - i);
+
+		i = j + 1;
+	}
+}
+
+// Modification time in nanoseconds, or -1 if the file does not exist
+mtime(name: *byte): int {
+	var st: stat;
+	var fd: int;
+
+	fd = open(name, O_RDONLY, 0);
+	if fd < 0 {
+		return -1;
+	}
+
+	if fstat(fd, (&st):*byte) < 0 {
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return st.mtime * 1000000000 + st.mtime_nsec;
+}
+
+mkstale(m: *mk, t: *mktarget, cc: *mkword): int {
+	var out: int;
+	var w: *mkword;
+
+	out = mtime(t.name);
+	if out < 0 {
+		return 1;
+	}
+
+	if mtime(cc.s) > out {
+		return 1;
+	}
+
+	w = t.words;
+	loop {
+		if !w {
+			return 0;
+		}
+
+		if mtime(w.s) > out {
+			return 1;
+		}
+
+		w = w.next;
+	}
+}
+
+mkcount(w: *mkword): int {
+	var n: int;
+	n = 0;
+	loop {
+		if !w {
+			return n;
+		}
+		n = n + 1;
+		w = w.next;
+	}
+}
+
+mkspawn(m: *mk, t: *mktarget, cc: *mkword) {
+	var argv: **byte;
+	var w: *mkword;
+	var n: int;
+	var pid: int;
+
+	argv = alloc(m.a, (mkcount(cc) + mkcount(t.words) + 3) * sizeof(*argv)):**byte;
+
+	n = 0;
+	w = cc;
+	loop {
+		if !w {
+			break;
+		}
+		argv[n] = w.s;
+		n = n + 1;
+		w = w.next;
+	}
+
+	w = t.words;
+	loop {
+		if !w {
+			break;
+		}
+		argv[n] = w.s;
+		n = n + 1;
+		w = w.next;
+	}
+
+	argv[n] = "-o";
+	argv[n + 1] = t.name;
+	argv[n + 2] = 0:*byte;
+
+	fdputs(1, t.name);
+	fdputs(1, "\n");
+
+	pid = fork();
+	if pid < 0 {
+		die("fork failed");
+	}
+
+	if pid == 0 {
+		exec(argv[0], argv, m.envp);
+		fdputs(2, "mk: exec failed: ");
+		fdputs(2, argv[0]);
+		fdputs(2, "\n");
+		exit(127);
+	}
+
+	t.pid = pid;
+}
+
+mkatoi(s: *byte): int {
+	var n: int;
+	var i: int;
+	var ch: int;
+
+	n = 0;
+	i = 0;
+	loop {
+		ch = s[i]:int;
+		if !ch {
+			break;
+		}
+
+		if ch < '0' || ch > '9' {
+			return -1;
+		}
+
+		n = n * 10 + ch - '0';
+		i = i + 1;
+	}
+
+	if i == 0 {
+		return -1;
+	}
+
+	return n;
+}
+
+// Number of cpus this process may run on
+ncpu(a: *alloc): int {
+	var mask: *byte;
+	var n: int;
+	var i: int;
+	var x: int;
+
+	mask = alloc(a, 128);
+
+	n = sched_getaffinity(0, 128, mask);
+	if n <= 0 {
+		return 1;
+	}
+
+	x = 0;
+	i = 0;
+	loop {
+		if i == n * 8 {
+			break;
+		}
+		if (mask[i >> 3]:int >> (i & 7)) & 1 {
+			x = x + 1;
+		}
+		i = i + 1;
+	}
+
+	if x == 0 {
+		return 1;
+	}
+
+	return x;
+}
+
+main(argc: int, argv: **byte, envp: **byte) {
+	var a: alloc;
+	var m: mk;
+	var cc: *mkword;
+	var v: *mkvar;
+	var t: *mktarget;
+	var next: *mktarget;
+	var jobs: int;
+	var running: int;
+	var failed: int;
+	var status: int;
+	var pid: int;
+	var i: int;
+
+	setup_alloc(&a);
+
+	m.a = &a;
+	m.filename = "build.mk";
+	m.lineno = 0;
+	m.vars = 0:*mkvar;
+	m.targets = 0:*mktarget;
+	m.last = 0:*mktarget;
+	m.envp = envp;
+
+	jobs = 0;
+
+	i = 1;
+	loop {
+		if i >= argc {
+			break;
+		}
+
+		if !strcmp(argv[i], "-j") {
+			if i + 1 >= argc {
+				die("usage: mk [-j jobs] [file]");
+			}
+			jobs = mkatoi(argv[i + 1]);
+			if jobs <= 0 {
+				die("mk: invalid -j");
+			}
+			i = i + 2;
+			continue;
+		}
+
+		if argv[i][0] == '-':byte {
+			die("usage: mk [-j jobs] [file]");
+		}
+
+		m.filename = argv[i];
+		i = i + 1;
+	}
+
+	if jobs == 0 {
+		jobs = ncpu(&a);
+	}
+
+	mkparse(&m);
+
+	v = mkfind(&m, "CC");
+	if v && v.words {
+		cc = v.words;
+	} else {
+		cc = mksplit(&m, "./cc2", 5);
+	}
+
+	// Drop targets that are up to date
+	t = m.targets;
+	m.targets = 0:*mktarget;
+	m.last = 0:*mktarget;
+	loop {
+		if !t {
+			break;
+		}
+
+		next = t.next;
+		if mkstale(&m, t, cc) {
+			t.next = 0:*mktarget;
+			if m.last {
+				m.last.next = t;
+			} else {
+				m.targets = t;
+			}
+			m.last = t;
+		}
+
+		t = next;
+	}
+
+	// Start jobs as others finish
+	running = 0;
+	failed = 0;
+	next = m.targets;
+	loop {
+		loop {
+			if failed || !next || running == jobs {
+				break;
+			}
+
+			mkspawn(&m, next, cc);
+			running = running + 1;
+			next = next.next;
+		}
+
+		if running == 0 {
+			break;
+		}
+
+		pid = wait(-1, &status, 0);
+		if pid < 0 {
+			die("mk: wait failed");
+		}
+
+		t = m.targets;
+		loop {
+			if !t || t.pid == pid {
+				break;
+			}
+			t = t.next;
+		}
+
+		if !t {
+			continue;
+		}
+
+		running = running - 1;
+
+		if status != 0 {
+			fdputs(2, "mk: failed to build ");
+			fdputs(2, t.name);
+			fdputs(2, "\n");
+			unlink(t.name);
+			failed = 1;
+		}
+	}
+
+	if failed {
+		exit(1);
+	}
+}
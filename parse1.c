@@ -1,10 +1,14 @@
+// A node is seven words. Children stay pointers rather than 32-bit indexes
+// into a node array because the language has no sub-word struct fields,
+// so an index would save nothing unless two were packed into a word, and
+// every child access in the compiler would then have to unpack one. The
+// type stays in the node too: nearly every expression node gets one, so a
+// side table would take as much memory and add a lookup to each use.
 struct node {
 	kind: int;
 	a: *node;
 	b: *node;
-	filename: *byte;
-	lineno: int;
-	colno: int;
+	loc: int;
 	n: int;
 	s: *byte;
 	t: *type;
@@ -77,9 +81,7 @@ mknode(c: *compiler, kind: int, a: *node, b: *node): *node {
 	ret.kind = kind;
 	ret.a = a;
 	ret.b = b;
-	ret.filename = c.filename;
-	ret.lineno = c.lineno;
-	ret.colno = c.colno;
+	ret.loc = mkloc(c);
 	ret.n = 0;
 	ret.s = 0:*byte;
 	ret.t = 0:*type;
@@ -327,7 +329,7 @@ parse_post_expr(c: *compiler): *node {
 	var n: *node;
 	var b: *node;
 
-	if (c.tt == T_IDENT && !strcmp(c.token, "sizeof")) {
+	if (c.tt == T_SIZEOF) {
 		feed(c);
 
 		if (c.tt != T_LPAR) {
@@ -787,7 +789,7 @@ parse_if_stmt(c: *compiler): *node {
 	var a: *node;
 	var b: *node;
 
-	if (c.tt != T_IDENT || strcmp(c.token, "if")) {
+	if (c.tt != T_IF) {
 		return 0:*node;
 	}
 	feed(c);
@@ -815,7 +817,7 @@ parse_if_stmt(c: *compiler): *node {
 
 		e.a = mknode(c, N_COND, a, b);
 
-		if (c.tt != T_IDENT || strcmp(c.token, "else")) {
+		if (c.tt != T_ELSE) {
 			return n;
 		}
 		feed(c);
@@ -835,7 +837,7 @@ parse_if_stmt(c: *compiler): *node {
 			return n;
 		}
 
-		if (c.tt != T_IDENT || strcmp(c.token, "if")) {
+		if (c.tt != T_IF) {
 			cdie(c, "expected if");
 		}
 		feed(c);
@@ -849,7 +851,7 @@ parse_if_stmt(c: *compiler): *node {
 parse_loop_stmt(c: *compiler): *node {
 	var a: *node;
 
-	if (c.tt != T_IDENT || strcmp(c.token, "loop")) {
+	if (c.tt != T_LOOP) {
 		return 0:*node;
 	}
 	feed(c);
@@ -871,7 +873,7 @@ parse_loop_stmt(c: *compiler): *node {
 
 // break_stmt := 'break'
 parse_break_stmt(c: *compiler): *node {
-	if (c.tt != T_IDENT || strcmp(c.token, "break")) {
+	if (c.tt != T_BREAK) {
 		return 0:*node;
 	}
 	feed(c);
@@ -881,7 +883,7 @@ parse_break_stmt(c: *compiler): *node {
 
 // continue_stmt := 'continue'
 parse_continue_stmt(c: *compiler): *node {
-	if (c.tt != T_IDENT || strcmp(c.token, "continue")) {
+	if (c.tt != T_CONTINUE) {
 		return 0:*node;
 	}
 	feed(c);
@@ -894,7 +896,7 @@ parse_continue_stmt(c: *compiler): *node {
 parse_return_stmt(c: *compiler): *node {
 	var a: *node;
 
-	if (c.tt != T_IDENT || strcmp(c.token, "return")) {
+	if (c.tt != T_RETURN) {
 		return 0:*node;
 	}
 	feed(c);
@@ -932,7 +934,7 @@ parse_var_decl(c: *compiler): *node {
 parse_var_stmt(c: *compiler): *node {
 	var a: *node;
 
-	if (c.tt != T_IDENT || strcmp(c.token, "var")) {
+	if (c.tt != T_VAR) {
 		return 0:*node;
 	}
 	feed(c);
@@ -966,7 +968,7 @@ parse_label_stmt(c: *compiler): *node {
 parse_goto_stmt(c: *compiler): *node {
 	var a: *node;
 
-	if (c.tt != T_IDENT || strcmp(c.token, "goto")) {
+	if (c.tt != T_GOTO) {
 		return 0:*node;
 	}
 	feed(c);
@@ -1159,11 +1161,7 @@ parse_enum_list(c: *compiler): *node {
 parse_enum_decl(c: *compiler): *node {
 	var b: *node;
 
-	if (c.tt != T_IDENT) {
-		return 0:*node;
-	}
-
-	if (strcmp(c.token, "enum")) {
+	if (c.tt != T_ENUM) {
 		return 0:*node;
 	}
 	feed(c);
@@ -1211,7 +1209,7 @@ parse_type(c: *compiler): *node {
 		return n;
 	}
 
-	if (c.tt == T_IDENT && !strcmp(c.token, "func")) {
+	if (c.tt == T_FUNC) {
 		feed(c);
 
 		n = parse_func_type(c);
@@ -1285,11 +1283,7 @@ parse_struct_decl(c: *compiler): *node {
 	var a: *node;
 	var b: *node;
 
-	if (c.tt != T_IDENT) {
-		return 0:*node;
-	}
-
-	if (strcmp(c.token, "struct")) {
+	if (c.tt != T_STRUCT) {
 		return 0:*node;
 	}
 	feed(c);
@@ -4,6 +4,7 @@ struct shell {
 	argv: **byte;
 	argc: int;
 	scriptfd: int;
+	in: *file;
 	script: *byte;
 	c: int;
 	tt: int;
@@ -39,7 +40,10 @@ feedc(s: *shell) {
 	}
 
 	if s.scriptfd >= 0 {
-		s.c = fdgetc(s.scriptfd);
+		if !s.in {
+			s.in = fopen(s.scriptfd, s.a);
+		}
+		s.c = fgetc(s.in);
 		return;
 	}
 
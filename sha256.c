@@ -425,8 +425,8 @@ sha256_hmac(mac: *byte, key: *byte, klen: int, data: *byte, dlen: int) {
 			break;
 		}
 
-		ipad[i] = digest[i] ^ (0x36:byte);
-		opad[i] = digest[i] ^ (0x5c:byte);
+		ipad[i] = (digest[i]:int ^ 0x36):byte;
+		opad[i] = (digest[i]:int ^ 0x5c):byte;
 
 		i = i + 1;
 	}
@@ -1503,7 +1503,6 @@ doexec(cr: *ssh_cr_exec, ctx: *sshd_ctx): int {
 	argv.arg2 = cmd;
 	argv.arg3 = 0:*byte;
 	ssh_spawn(ctx, &argv.arg0);
-	free(ctx.a, cmd);
 	return 1;
 }
 
@@ -1622,6 +1621,7 @@ poll_client(revents: int, ctx: *sshd_ctx) {
 	var sr: ssh_channel_request;
 	var sc: ssh_channel_close;
 	var se: ssh_channel_eof;
+	var mark: *alloc_mark;
 	if revents & POLLOUT {
 		if ctx.stdin_window > 1024 {
 			swa.channel = 0;
@@ -1696,6 +1696,9 @@ poll_client(revents: int, ctx: *sshd_ctx) {
 			exit(0);
 		}
 	} else {
+		// Anything allocated to handle a packet is dropped with it
+		mark = alloc_mark(ctx.a);
+
 		read_frame(ctx);
 
 		tag = ctx.frame[0]:int;
@@ -1716,6 +1719,8 @@ poll_client(revents: int, ctx: *sshd_ctx) {
 		} else {
 			die("invalid packet");
 		}
+
+		alloc_release(ctx.a, mark);
 	}
 }
 
@@ -1778,7 +1783,7 @@ poll_exit(ctx: *sshd_ctx) {
 		}
 		if ret == ctx.child_pid {
 			ctx.child_pid = -1;
-			ctx.exit_status = status;
+			ctx.exit_status = (status >> 8) & 255;
 		}
 	}
 }
@@ -22,6 +22,17 @@ enum {
 
 	WNOHANG = 1,
 
+	PROT_READ = 1,
+	PROT_WRITE = 2,
+	MAP_PRIVATE = 2,
+
+	MREMAP_MAYMOVE = 1,
+
+	S_IFMT = 0xf000,
+	S_IFREG = 0x8000,
+
+	CLOCK_MONOTONIC = 1,
+
 	SIG_DFL = 0,
 	SIG_IGN = 1,
 
@@ -53,6 +64,27 @@ close(fd: int): int {
 	return syscall(3, fd, 0, 0, 0, 0, 0);
 }
 
+struct stat {
+	dev: int;
+	ino: int;
+	nlink: int;
+	uid_mode: int;
+	gid: int;
+	rdev: int;
+	size: int;
+	blksize: int;
+	blocks: int;
+	atime: int;
+	atime_nsec: int;
+	mtime: int;
+	mtime_nsec: int;
+	ctime: int;
+	ctime_nsec: int;
+	pad0: int;
+	pad1: int;
+	pad2: int;
+}
+
 fstat(fd: int, buf: *byte): int {
 	return syscall(5, fd, buf:int, 0, 0, 0, 0);
 }
@@ -61,10 +93,18 @@ poll(pfd: *int, nfd: int, timeout: int): int {
 	return syscall(7, pfd:int, nfd, timeout, 0, 0, 0);
 }
 
+lseek(fd: int, off: int, whence: int): int {
+	return syscall(8, fd, off, whence, 0, 0, 0);
+}
+
 mmap(addr: int, len: int, prot: int, flags: int, fd: int, off: int): int {
 	return syscall(9, addr, len, prot, flags, fd, off);
 }
 
+munmap(addr: int, len: int): int {
+	return syscall(11, addr, len, 0, 0, 0, 0);
+}
+
 struct sigaction {
 	handler: int;
 	flags: int;
@@ -87,6 +127,10 @@ pipe(rfd: *int, wfd: *int): int {
 	return ret;
 }
 
+mremap(addr: int, len: int, newlen: int, flags: int): int {
+	return syscall(25, addr, len, newlen, flags, 0, 0);
+}
+
 dup2(old: int, new: int): int {
 	return syscall(33, old, new, 0, 0, 0, 0);
 }
@@ -123,7 +167,7 @@ wait(pid: int, status: *int, flags: int): int {
 	var s: int;
 	var ret: int;
 	s = 0;
-	ret = syscall(61, pid, s:int, flags, 0, 0, 0);
+	ret = syscall(61, pid, (&s):int, flags, 0, 0, 0);
 	if status {
 		*status = s & (-1 >> 32);
 	}
@@ -142,6 +186,25 @@ unlink(name: *byte): int {
 	return syscall(87, name: int, 0, 0, 0, 0, 0);
 }
 
+struct timespec {
+	sec: int;
+	nsec: int;
+}
+
+clock_gettime(id: int, ts: *timespec): int {
+	return syscall(228, id, ts:int, 0, 0, 0, 0);
+}
+
+sched_getaffinity(pid: int, len: int, mask: *byte): int {
+	return syscall(204, pid, len, mask:int, 0, 0, 0);
+}
+
 getdirents(fd: int, buf: *byte, len: int): int {
 	return syscall(217, fd, buf:int, len, 0, 0, 0);
 }
+
+// Set the access and modification times of an open file, to now if times
+// is null
+futimens(fd: int, times: *timespec): int {
+	return syscall(280, fd, 0, times:int, 0, 0, 0);
+}
@@ -120,7 +120,7 @@ prototype(c: *compiler, n: *node): *type {
 		return 0:*type;
 	}
 
-	c.lineno = n.lineno;
+	set_loc(c, n.loc);
 	c.colno = 0;
 
 	kind = n.kind;
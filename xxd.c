@@ -1,30 +1,13 @@
-doxxd(fd: int, buf: *byte) {
+doxxd(in: *file, buf: *byte, out: *file) {
 	var n: int;
 	var m: int;
-	var ret: int;
 
 	m = 0;
 	loop {
-		n = 0;
-		loop {
-			ret = read(fd, buf, 16 - n);
-			if ret == 0 {
-				break;
-			}
-
-			if ret < 0 {
-				die("read failed");
-			}
-
-			n = n + ret;
-
-			if n == 16 {
-				break;
-			}
-		}
+		n = fread(in, buf, 16);
 
 		xxd_line(&buf[16], m, buf, n);
-		fdputs(1, &buf[16]);
+		fputs(out, &buf[16]);
 
 		if n < 16 {
 			break;
@@ -39,18 +22,23 @@ main(argc: int, argv: **byte, envp: **byte) {
 	var i: int;
 	var a: alloc;
 	var buf: *byte;
+	var out: *file;
 
 	setup_alloc(&a);
 
+	out = fopen(1, &a);
+
 	buf = alloc(&a, 4096);
 
 	if argc == 1 {
-		doxxd(0, buf);
+		doxxd(fopen(0, &a), buf, out);
 	} else if argc == 2 {
 		fd = open(argv[1], 0, 0);
-		doxxd(fd, buf);
+		doxxd(fopen(fd, &a), buf, out);
 		close(fd);
 	} else {
 		die("usage: xxd [file]");
 	}
+
+	fflush(out);
 }